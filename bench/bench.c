@@ -0,0 +1,541 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+/*
+  smalloc_bench - allocator benchmarks (hosted builds only)
+
+  Every workload is driven by a fixed-seed PRNG, so runs are reproducible,
+  and is run against smalloc and then the system malloc as a baseline.
+  Each smalloc/sfree (malloc/free) is timed on its own, which gives the
+  mean, p50 and p99 latencies, and the worst case. With -r, the workload is
+  repeated and each operation keeps its fastest time, which takes most of
+  the noise (interrupts, the scheduler) out of the worst case. For smalloc, the heap is sampled with
+  __smalloc_used / __smalloc_avail for the peak heap size and the
+  fragmentation ratio: bytes sitting in freed chunks / bytes carved out of
+  blocks, at the point the live set is largest.
+  The smalloc heap is an mmap reservation (__smalloc_init_mmap) of heapSize.
+
+  usage: smalloc_bench [-w workload] [-n ops] [-h heapSize] [-p pageSize]
+                       [-s seed] [-r repeats] [-t trace | -b binaryTrace [-P pointerBytes]]
+    workloads: fixed, random, prodcons, frag, worst, trace (needs -t or -b),
+               all (default, and includes trace when one is given)
+
+  A trace is a text file, one operation per line:
+    a <id> <size>       allocate size bytes as object id
+    r <id> <size>       reallocate object id to size bytes
+    f <id>              free object id
+
+  A binary trace is a dump of struct STRACE records from a SMALLOC_TRACE
+  build (see smalloc.h), and names objects by the pointers they were given.
+  -P is the size of a pointer in the build that made it: 4 (the default) or 8.
+*/
+
+#include "libsmallc/smalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LIVE        4096        // live objects a workload may hold
+#define STATS_EVERY     16          // heap statistics are sampled every N operations
+
+struct ALLOCATOR {
+    const char *name;
+    void *(*alloc)(unsigned long);
+    void *(*realloc)(void *, unsigned long);
+    void (*free)(void *);
+    int hasStats;                   // heap statistics are available
+};
+
+static void *sys_alloc(unsigned long n) { return malloc(n); }
+static void *sys_realloc(void *p, unsigned long n) { return realloc(p, n); }
+static void sys_free(void *p) { free(p); }
+
+static struct ALLOCATOR allocators[] = {
+    { "smalloc", smalloc, srealloc, sfree, 1 },
+    { "malloc", sys_alloc, sys_realloc, sys_free, 0 },
+};
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+// run configuration
+static unsigned long opsPerRun = 200000;
+static unsigned long heapSize = 16UL << 20;
+static unsigned long pageSize = 8192;
+static unsigned long seed = 1;
+static unsigned long repeats = 1;
+static const char *tracePath = NULL;
+static int traceBinary = 0;         // tracePath is a dump of struct STRACE records
+static unsigned long tracePointer = 4;  // bytes in the ptr and old fields of those records
+
+#ifndef SMALLOC_MMAP
+static void *heap = NULL;
+#endif
+
+// measurements for one run
+struct RESULTS {
+    unsigned long *allocNs, *freeNs;
+    unsigned long allocs, frees, maxOps;
+    unsigned long peakHeap;
+    unsigned long peakLive;         // the most live bytes seen
+    double fragmentation;           // at peakLive
+    int failed;                     // allocation failures
+};
+
+static struct ALLOCATOR *current;
+static struct RESULTS results;
+static unsigned long repeat;        // of the current run, from 0
+static unsigned long liveBytes;
+static unsigned long sinceStats;
+
+// xorshift -- reproducible and not the thing being measured
+static unsigned long rngState;
+static unsigned long rng(void) {
+    unsigned long x = rngState;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rngState = x;
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void sample_heap(void) {
+    if(!current->hasStats) return;
+    unsigned short blocks;
+    unsigned long inBlocks, avail, inFree;
+    unsigned long total = __smalloc_used(&blocks, &inBlocks);
+    __smalloc_avail(&avail, &inFree);
+    if(total > results.peakHeap) results.peakHeap = total;
+    if(liveBytes >= results.peakLive) {
+        results.peakLive = liveBytes;
+        results.fragmentation = inBlocks ? (double)inFree / inBlocks : 0;
+    }
+}
+
+static void after_op(void) {
+    if(++sinceStats >= STATS_EVERY) {
+        sinceStats = 0;
+        sample_heap();
+    }
+}
+
+// the live objects of a workload
+static void *live[MAX_LIVE];
+static unsigned long liveSize[MAX_LIVE];
+
+// keep the time of the next operation -- the fastest one, over the repeats
+static void record(unsigned long *ns, unsigned long *count, unsigned long elapsed) {
+    if(*count >= results.maxOps) return;
+    if(repeat && ns[*count] < elapsed) elapsed = ns[*count];
+    ns[(*count)++] = elapsed;
+}
+
+static void timed_alloc(unsigned slot, unsigned long n) {
+    unsigned long start = now_ns();
+    void *p = current->alloc(n);
+    unsigned long elapsed = now_ns() - start;
+    record(results.allocNs, &results.allocs, elapsed);
+    if(!p) {
+        results.failed++;
+        return;
+    }
+    *(char *)p = (char)slot; // touch it
+    live[slot] = p;
+    liveSize[slot] = n;
+    liveBytes += n;
+    after_op();
+}
+
+static void timed_realloc(unsigned slot, unsigned long n) {
+    unsigned long start = now_ns();
+    void *p = current->realloc(live[slot], n);
+    unsigned long elapsed = now_ns() - start;
+    record(results.allocNs, &results.allocs, elapsed);
+    if(!p) {
+        results.failed++;
+        return;
+    }
+    liveBytes += n - liveSize[slot];
+    live[slot] = p;
+    liveSize[slot] = n;
+    after_op();
+}
+
+static void timed_free(unsigned slot) {
+    unsigned long start = now_ns();
+    current->free(live[slot]);
+    unsigned long elapsed = now_ns() - start;
+    record(results.freeNs, &results.frees, elapsed);
+    liveBytes -= liveSize[slot];
+    live[slot] = NULL;
+    after_op();
+}
+
+static void free_all(void) {
+    for(unsigned i = 0; i < MAX_LIVE; i++) {
+        if(live[i]) timed_free(i);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// workloads
+//////////////////////////////////////////////////////////////////////////
+
+// the same small struct size allocated and freed over and over
+static void wl_fixed(void) {
+    for(unsigned long i = 0; i < opsPerRun; i++) {
+        unsigned slot = rng() % 512;
+        if(live[slot]) timed_free(slot);
+        else timed_alloc(slot, 24);
+    }
+}
+
+// mostly small, sometimes large, sizes, freed at random
+static void wl_random(void) {
+    for(unsigned long i = 0; i < opsPerRun; i++) {
+        unsigned slot = rng() % MAX_LIVE;
+        if(live[slot]) timed_free(slot);
+        else timed_alloc(slot, (rng() % 8) ? 1 + rng() % 256 : 1 + rng() % 8192);
+    }
+}
+
+// a FIFO of messages: allocated at the head, freed from the tail
+static void wl_prodcons(void) {
+    unsigned head = 0, tail = 0;
+    for(unsigned long i = 0; i < opsPerRun; i++) {
+        unsigned queued = head - tail;
+        if(queued < MAX_LIVE && (queued < 64 || rng() % 2)) {
+            timed_alloc(head++ % MAX_LIVE, 16 + rng() % 496);
+        } else {
+            timed_free(tail++ % MAX_LIVE);
+        }
+    }
+}
+
+// fill with small objects, free every other one, then ask for bigger objects
+// that won't fit into the holes
+static void wl_frag(void) {
+    unsigned long done = 0;
+    while(done < opsPerRun) {
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot++, done++) {
+            if(!live[slot]) timed_alloc(slot, 16 + rng() % 48);
+        }
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot += 2, done++) {
+            timed_free(slot);
+        }
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot += 4, done++) {
+            timed_alloc(slot, 128 + rng() % 256);
+        }
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot++, done++) {
+            if(live[slot] && rng() % 2) timed_free(slot);
+        }
+    }
+}
+
+// the slow paths, for the worst case: many blocks, every bin and tree holding
+// chunks of many sizes, requests that none of them fit, and frees that empty blocks
+static void wl_worst(void) {
+    unsigned long done = 0;
+    while(done < opsPerRun) {
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot++, done++) {
+            if(!live[slot]) timed_alloc(slot, slot % 4 ? 16 + rng() % 240 : 256 + rng() % 8192);
+        }
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot += 2, done++) {
+            timed_free(slot);
+        }
+        for(unsigned slot = 0; slot < MAX_LIVE && done < opsPerRun; slot += 64, done++) {
+            timed_alloc(slot, 8192 + rng() % 8192);
+        }
+        for(unsigned long i = 0; i < MAX_LIVE && done < opsPerRun; i++, done++) {
+            unsigned slot = rng() % MAX_LIVE;
+            if(live[slot]) timed_free(slot);
+        }
+        for(unsigned slot = MAX_LIVE; slot-- > 0 && done < opsPerRun; done++) {
+            if(live[slot]) timed_free(slot);
+        }
+    }
+}
+
+// binary traces name objects by their recorded pointers -- an open-addressed
+// map from those to live slots (0 is an empty key)
+#define PTR_MAP_SZ      (MAX_LIVE * 2)
+static unsigned long mapKey[PTR_MAP_SZ];
+static unsigned mapSlot[PTR_MAP_SZ];
+static unsigned nextSlot;
+
+static unsigned map_index(unsigned long key) {
+    unsigned i = (unsigned)((key >> 3) * 2654435761UL) % PTR_MAP_SZ;
+    while(mapKey[i] && mapKey[i] != key) i = (i + 1) % PTR_MAP_SZ;
+    return i;
+}
+
+// remove the key at i, shifting back any keys that probed past it
+static void map_remove(unsigned i) {
+    mapKey[i] = 0;
+    for(unsigned j = (i + 1) % PTR_MAP_SZ; mapKey[j]; j = (j + 1) % PTR_MAP_SZ) {
+        unsigned long key = mapKey[j];
+        mapKey[j] = 0;
+        unsigned k = map_index(key);
+        mapKey[k] = key;
+        mapSlot[k] = mapSlot[j];
+    }
+}
+
+// a slot for a new object, or MAX_LIVE if they are all in use
+static unsigned free_slot(void) {
+    for(unsigned tries = 0; tries < MAX_LIVE; tries++) {
+        unsigned slot = nextSlot++ % MAX_LIVE;
+        if(!live[slot]) return slot;
+    }
+    return MAX_LIVE;
+}
+
+// map ptr to slot -- if ptr is still mapped, it was handed out again and
+// its free is missing from the trace (lost from the ring), so free it now
+static void map_put(unsigned long ptr, unsigned slot) {
+    unsigned i = map_index(ptr);
+    if(mapKey[i]) {
+        timed_free(mapSlot[i]);
+        map_remove(i);
+        i = map_index(ptr);
+    }
+    mapKey[i] = ptr;
+    mapSlot[i] = slot;
+}
+
+static void replay_alloc(unsigned long ptr, unsigned long size) {
+    if(!ptr) return; // it failed when it was traced
+    unsigned slot = free_slot();
+    if(slot == MAX_LIVE) return;
+    timed_alloc(slot, size);
+    if(live[slot]) map_put(ptr, slot);
+}
+
+static unsigned long get_le(const unsigned char *bytes, unsigned count) {
+    unsigned long value = 0;
+    while(count--) value = value << 8 | bytes[count];
+    return value;
+}
+
+// replay a dump of struct STRACE records: op, size[3], tick[4], ptr[P], old[P]
+static void replay_binary(FILE *trace) {
+    unsigned char record[8 + 2 * 8];
+    if(tracePointer != 4 && tracePointer != 8) {
+        fprintf(stderr, "-P must be 4 or 8\n");
+        return;
+    }
+    memset(mapKey, 0, sizeof(mapKey));
+    nextSlot = 0;
+    while(fread(record, 8 + 2 * tracePointer, 1, trace) == 1) {
+        unsigned long size = get_le(record + 1, 3);
+        unsigned long ptr = get_le(record + 8, tracePointer);
+        unsigned long old = get_le(record + 8 + tracePointer, tracePointer);
+        if(record[0] == 'r' && !old) record[0] = 'a'; // srealloc(NULL, n)
+        if(record[0] == 'a') {
+            replay_alloc(ptr, size);
+            continue;
+        }
+        unsigned i = map_index(record[0] == 'r' ? old : ptr);
+        if(!mapKey[i]) continue; // not traced, or failed when it was
+        unsigned slot = mapSlot[i];
+        if(record[0] == 'f' || (record[0] == 'r' && !size)) {
+            timed_free(slot);
+            map_remove(i);
+        } else if(record[0] == 'r' && ptr) {
+            timed_realloc(slot, size);
+            map_remove(i);
+            map_put(ptr, slot);
+        }
+    }
+}
+
+// replay a recorded trace
+static void wl_trace(void) {
+    FILE *trace = fopen(tracePath, traceBinary ? "rb" : "r");
+    if(!trace) {
+        perror(tracePath);
+        return;
+    }
+    if(traceBinary) {
+        replay_binary(trace);
+        fclose(trace);
+        return;
+    }
+    char op;
+    unsigned long id, size;
+    while(fscanf(trace, " %c %lu", &op, &id) == 2) {
+        if(op != 'f' && fscanf(trace, "%lu", &size) != 1) break;
+        unsigned slot = id % MAX_LIVE;
+        if(op == 'a') {
+            if(live[slot]) timed_free(slot);
+            timed_alloc(slot, size);
+        } else if(op == 'r' && live[slot]) {
+            timed_realloc(slot, size);
+        } else if(op == 'f' && live[slot]) {
+            timed_free(slot);
+        }
+    }
+    fclose(trace);
+}
+
+struct WORKLOAD {
+    const char *name;
+    void (*run)(void);
+};
+
+static struct WORKLOAD workloads[] = {
+    { "fixed", wl_fixed },
+    { "random", wl_random },
+    { "prodcons", wl_prodcons },
+    { "frag", wl_frag },
+    { "worst", wl_worst },
+    { "trace", wl_trace },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+//////////////////////////////////////////////////////////////////////////
+// reporting
+//////////////////////////////////////////////////////////////////////////
+
+static int cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double mean(unsigned long *ns, unsigned long n) {
+    double sum = 0;
+    for(unsigned long i = 0; i < n; i++) sum += ns[i];
+    return n ? sum / n : 0;
+}
+
+static unsigned long percentile(unsigned long *sorted, unsigned long n, unsigned p) {
+    return n ? sorted[(n - 1) * p / 100] : 0;
+}
+
+static void report(const char *workload) {
+    double allocMean = mean(results.allocNs, results.allocs);
+    double freeMean = mean(results.freeNs, results.frees);
+    qsort(results.allocNs, results.allocs, sizeof(unsigned long), cmp_ulong);
+    qsort(results.freeNs, results.frees, sizeof(unsigned long), cmp_ulong);
+
+    printf("%-9s %-8s %8lu %8.1f %5lu %5lu %6lu %8.1f %5lu %5lu %6lu",
+        workload, current->name, results.allocs,
+        allocMean, percentile(results.allocNs, results.allocs, 50), percentile(results.allocNs, results.allocs, 99),
+        percentile(results.allocNs, results.allocs, 100),
+        freeMean, percentile(results.freeNs, results.frees, 50), percentile(results.freeNs, results.frees, 99),
+        percentile(results.freeNs, results.frees, 100));
+    if(current->hasStats) {
+        printf(" %10lu %6.1f%%", results.peakHeap, results.fragmentation * 100);
+    } else {
+        printf(" %10s %7s", "-", "-");
+    }
+    if(results.failed) printf("  (%d failed)", results.failed);
+    printf("\n");
+}
+
+static void run(struct WORKLOAD *workload, struct ALLOCATOR *allocator) {
+    current = allocator;
+    for(repeat = 0; repeat < repeats; repeat++) {
+#ifdef SMALLOC_MMAP
+        // a fresh reservation for every run, grown and shrunk a page at a time
+        if(!__smalloc_init_mmap(heapSize, pageSize)) {
+            fprintf(stderr, "can't reserve a %lu byte heap\n", heapSize);
+            exit(1);
+        }
+#else
+        __smalloc_init((unsigned long)heap, (unsigned long)heap + heapSize - 1, pageSize);
+#endif
+
+        rngState = seed * 2654435761UL + 1;
+        memset(live, 0, sizeof(live));
+        liveBytes = 0;
+        sinceStats = 0;
+        results.allocs = results.frees = 0;
+        results.peakHeap = results.peakLive = 0;
+        results.fragmentation = 0;
+        results.failed = 0;
+
+        workload->run();
+        sample_heap();
+        free_all();
+    }
+    report(workload->name);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: smalloc_bench [-w workload] [-n ops] [-h heapSize] [-p pageSize] [-s seed] [-r repeats] [-t trace | -b binaryTrace [-P pointerBytes]]\n");
+    exit(2);
+}
+
+int main(int argc, const char *argv[]) {
+    const char *only = "all";
+    for(int i = 1; i < argc; i++) {
+        if(argv[i][0] != '-' || argv[i][2] || i + 1 >= argc) usage();
+        const char *value = argv[++i];
+        switch(argv[i - 1][1]) {
+            case 'w': only = value; break;
+            case 'n': opsPerRun = strtoul(value, NULL, 0); break;
+            case 'h': heapSize = strtoul(value, NULL, 0); break;
+            case 'p': pageSize = strtoul(value, NULL, 0); break;
+            case 's': seed = strtoul(value, NULL, 0); break;
+            case 'r': repeats = strtoul(value, NULL, 0); break;
+            case 't': tracePath = value; traceBinary = 0; break;
+            case 'b': tracePath = value; traceBinary = 1; break;
+            case 'P': tracePointer = strtoul(value, NULL, 0); break;
+            default: usage();
+        }
+    }
+
+    int known = !strcmp(only, "all");
+    for(unsigned w = 0; w < NUM_WORKLOADS; w++) {
+        if(!strcmp(only, workloads[w].name)) known = 1;
+    }
+    if(!known || (!strcmp(only, "trace") && !tracePath)) usage();
+
+#ifdef SMALLOC_MMAP
+    int haveHeap = 1; // each run reserves its own
+#else
+    heap = malloc(heapSize);
+    int haveHeap = heap != NULL;
+#endif
+    // every op of a run is an alloc or a free, plus the final free_all
+    results.maxOps = opsPerRun + MAX_LIVE;
+    results.allocNs = malloc(results.maxOps * sizeof(unsigned long));
+    results.freeNs = malloc(results.maxOps * sizeof(unsigned long));
+    if(!haveHeap || !results.allocNs || !results.freeNs) {
+        fprintf(stderr, "not enough memory for the benchmark\n");
+        return 1;
+    }
+
+    if(!repeats) usage();
+    printf("ops=%lu heap=%lu page=%lu seed=%lu repeats=%lu\n", opsPerRun, heapSize, pageSize, seed, repeats);
+    printf("%-9s %-8s %8s %8s %5s %5s %6s %8s %5s %5s %6s %10s %7s\n",
+        "workload", "alloc", "allocs", "alloc ns", "p50", "p99", "max", "free ns", "p50", "p99", "max", "peak heap", "frag");
+    for(unsigned w = 0; w < NUM_WORKLOADS; w++) {
+        int isTrace = workloads[w].run == wl_trace;
+        // "all" includes the trace only when one is given
+        if(strcmp(only, workloads[w].name) && (strcmp(only, "all") || (isTrace && !tracePath))) continue;
+        for(unsigned a = 0; a < NUM_ALLOCATORS; a++) run(&workloads[w], &allocators[a]);
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include "memcmp.h"
+#include "memword.h"
+
+// at a word that differs, leave the kernel's loop: from the unrolled loop the
+// one-word loop then stops at that word, and the tail finds the byte (CMP_WORD
+// isn't wrapped in a do/while, so its break is the kernel's)
+#define CMP_BYTE()          do { if(*_a != *_b) return *_a - *_b; _a++; _b++; } while(0)
+#define CMP_WORD(i)         if(MEM_LOAD(_a, i) != MEM_LOAD(_b, i)) break
+#define CMP_STEP(n)         (_a += (n), _b += (n))
+
+// Compare a word at a time while the words are equal; the first differing
+// word is compared again byte by byte to find the result.
+int memcmp(const void* a, const void* b, unsigned long count) {
+    const unsigned char* _a = (const unsigned char *)a;
+    const unsigned char* _b = (const unsigned char *)b;
+    if(_a == _b) return 0;
+
+    if(count >= MEM_UNROLL_SZ && MEM_CO_ALIGNED(_a, _b)) {
+        MEM_KERNEL(count, _a, CMP_BYTE, CMP_WORD, CMP_STEP);
+    }
+
+    // byte fallback: at the first mismatching word, or the tail
+    while(count) {
+        CMP_BYTE();
+        --count;
+    }
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef __MEMCMP_H
+#define __MEMCMP_H
+
+int memcmp(const void* a, const void* b, unsigned long count);
+
+#endif
\ No newline at end of file
@@ -1,11 +1,32 @@
 #include "memcpy.h"
+#include "memword.h"
+
+#define COPY_BYTE()         (*(_d++) = *(_s++))
+#define COPY_WORD(i)        (MEM_STORE(_d, i) = MEM_LOAD(_s, i))
+#define COPY_STEP(n)        (_d += (n), _s += (n))
 
 void* memcpy(void* dst, const void* src, unsigned long count) {
     char* _d = (char *)dst;
     const char* _s = (const char *)src;
-    while(_d && _s && count) {
-        *(_d++) = *(_s++);
+    if(!_d || !_s) return dst;
+
+    if(count >= MEM_UNROLL_SZ && MEM_CO_ALIGNED(_d, _s)) {
+        MEM_KERNEL(count, _d, COPY_BYTE, COPY_WORD, COPY_STEP);
+    }
+
+    // tail (or everything, when the pointers can't be aligned together)
+    while(count >= 4) {
+        _d[0] = _s[0];
+        _d[1] = _s[1];
+        _d[2] = _s[2];
+        _d[3] = _s[3];
+        _d += 4;
+        _s += 4;
+        count -= 4;
+    }
+    while(count) {
+        COPY_BYTE();
         --count;
     }
     return dst;
-}
\ No newline at end of file
+}
@@ -0,0 +1,31 @@
+#include "memmove.h"
+#include "memcpy.h"
+#include "memword.h"
+
+// backwards: the pointers are just past what is left to copy, and the highest
+// word goes first, so no word is overwritten before it is read
+#define MOVE_BYTE()         (*(--_d) = *(--_s))
+#define MOVE_WORD(i)        (MEM_STORE(_d, -1 - (i)) = MEM_LOAD(_s, -1 - (i)))
+#define MOVE_STEP(n)        (_d -= (n), _s -= (n))
+
+// Like memcpy, but dst and src may overlap.
+// A forward copy is safe unless dst starts inside src; then copy backwards,
+// from the end, with the same word kernel as memcpy.
+void* memmove(void* dst, const void* src, unsigned long count) {
+    char* _d = (char *)dst;
+    const char* _s = (const char *)src;
+    if(!_d || !_s || _d == _s) return dst;
+    if(_d < _s || _d >= _s + count) return memcpy(dst, src, count);
+
+    _d += count;
+    _s += count;
+    if(count >= MEM_UNROLL_SZ && MEM_CO_ALIGNED(_d, _s)) {
+        MEM_KERNEL(count, _d, MOVE_BYTE, MOVE_WORD, MOVE_STEP);
+    }
+
+    while(count) {
+        MOVE_BYTE();
+        --count;
+    }
+    return dst;
+}
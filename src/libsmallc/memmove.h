@@ -0,0 +1,6 @@
+#ifndef __MEMMOVE_H
+#define __MEMMOVE_H
+
+void* memmove(void* dst, const void* src, unsigned long count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include "memset.h"
+#include "memword.h"
+
+#define SET_BYTE()          (*(_d++) = (unsigned char)c)
+#define SET_WORD(i)         (MEM_STORE(_d, i) = pattern)
+#define SET_STEP(n)         (_d += (n))
+
+// Fill with a word holding c in every byte, four words per loop iteration.
+void* memset(void* dst, int c, unsigned long count) {
+    unsigned char* _d = (unsigned char *)dst;
+    if(!_d) return dst;
+
+    if(count >= MEM_UNROLL_SZ) {
+        // broadcast the byte to every byte of a word
+        MEM_WORD pattern = (unsigned char)c;
+        pattern |= pattern << 8;
+        pattern |= pattern << 16;
+        if(MEM_WORD_SZ > 4) pattern |= (pattern << 16) << 16;
+
+        MEM_KERNEL(count, _d, SET_BYTE, SET_WORD, SET_STEP);
+    }
+
+    while(count) {
+        SET_BYTE();
+        --count;
+    }
+    return dst;
+}
@@ -0,0 +1,6 @@
+#ifndef __MEMSET_H
+#define __MEMSET_H
+
+void* memset(void* dst, int c, unsigned long count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef __MEMWORD_H
+#define __MEMWORD_H
+
+// The word-at-a-time kernel of memcpy, memmove, memset and memcmp (MEM_KERNEL),
+// and the word tests strlen shares with them.
+// Bulk work moves a machine word (unsigned long) at a time, four words per
+// loop iteration. Words are only used when the pointers can all be word
+// aligned -- unaligned word access traps on the 68000 and is slow elsewhere.
+#if defined(__GNUC__)
+typedef unsigned long __attribute__((__may_alias__)) MEM_WORD;
+#else
+typedef unsigned long MEM_WORD;
+#endif
+
+#define MEM_WORD_SZ         (sizeof(MEM_WORD))
+#define MEM_WORD_MASK       (MEM_WORD_SZ - 1)
+#define MEM_UNROLL_SZ       (4 * MEM_WORD_SZ)
+
+// non-zero when p is word aligned
+#define MEM_ALIGNED(p)      (!((unsigned long)(p) & MEM_WORD_MASK))
+// non-zero when a and b can be word aligned at the same time
+#define MEM_CO_ALIGNED(a, b) (!(((unsigned long)(a) ^ (unsigned long)(b)) & MEM_WORD_MASK))
+
+// the i'th word from the (word aligned) byte pointer p, to store to or load from
+#define MEM_STORE(p, i)     (((MEM_WORD *)(p))[i])
+#define MEM_LOAD(p, i)      (((const MEM_WORD *)(p))[i])
+
+// The kernel: BYTE() does one byte, and moves the pointers on, until lead is word
+// aligned (the head); then WORD(i) does the i'th word from the pointers -- four of
+// them while MEM_UNROLL_SZ bytes are left, then one while a word is -- and STEP(n)
+// moves the pointers n bytes on (the body). count goes down as they go; the bytes
+// left, fewer than a word, are the caller's tail. Only use it with count of at
+// least MEM_UNROLL_SZ, so the head can't run out of bytes.
+#define MEM_KERNEL(count, lead, BYTE, WORD, STEP) do { \
+        while(!MEM_ALIGNED(lead)) { \
+            BYTE(); \
+            --(count); \
+        } \
+        while((count) >= MEM_UNROLL_SZ) { \
+            WORD(0); \
+            WORD(1); \
+            WORD(2); \
+            WORD(3); \
+            STEP(MEM_UNROLL_SZ); \
+            (count) -= MEM_UNROLL_SZ; \
+        } \
+        while((count) >= MEM_WORD_SZ) { \
+            WORD(0); \
+            STEP(MEM_WORD_SZ); \
+            (count) -= MEM_WORD_SZ; \
+        } \
+    } while(0)
+
+// 0x01 and 0x80 in every byte of a word
+#define MEM_ONES            ((MEM_WORD)-1 / 0xff)
+#define MEM_HIGHS           (MEM_ONES << 7)
+// non-zero when any byte of the word v is zero ("haszero")
+// a byte's high bit survives only if the byte borrowed in the subtraction
+// and did not have its high bit set already -- i.e. it was zero
+#define MEM_HAS_ZERO(v)     (((v) - MEM_ONES) & ~(v) & MEM_HIGHS)
+
+#endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+#include "sarena.h"
+#include "smalloc_internal.h"
+
+/*
+  "sarena" - bump allocated scratch regions
+
+- An arena is one BLOCK claimed from the heap (__claim_block) as BLOCK_ARENA,
+  so smalloc never carves CHUNKs out of it.
+- The arena's book-keeping lives at the start of the block's space and the
+  rest is bumped through with block->top / block->remaining, exactly like
+  CHUNKs are carved from a block -- but without CHUNK headers.
+- Reset moves top back to the first allocation.
+- An arena is not locked (SMALLOC_SAFE); only taking its block from the heap is.
+*/
+
+struct SARENA {
+    struct BLOCK* block;
+    void* base;                 // first allocatable byte, where top goes back to
+};
+
+#define ARENA_HEADER_SZ     ALIGN_UP(sizeof(struct SARENA), SMALLOC_ALIGN)
+
+struct SARENA *sarena_begin(SIZE_T size) {
+    SMALLOC_LOCK();
+    struct BLOCK* block = __claim_block(ARENA_HEADER_SZ + size, BLOCK_ARENA);
+    SMALLOC_UNLOCK();
+    if(!block) return NULL;
+
+    struct SARENA* arena = block->top;
+    arena->block = block;
+    arena->base = block->top + ARENA_HEADER_SZ;
+    sarena_reset(arena);
+    return arena;
+}
+
+void *sarena_alloc(struct SARENA* arena, SIZE_T n) {
+    struct BLOCK* block = arena->block;
+    if(n > block->remaining) return NULL;
+    // keep every allocation aligned like smalloc's -- remaining is a
+    // multiple of SMALLOC_ALIGN, so the rounded size still fits
+    n = ALIGN_UP(n, SMALLOC_ALIGN);
+    void* p = block->top;
+    block->top += n;
+    block->remaining -= n;
+    return p;
+}
+
+void sarena_reset(struct SARENA* arena) {
+    struct BLOCK* block = arena->block;
+    block->top = arena->base;
+    block->remaining = block->size - (arena->base - (void *)block);
+}
+
+// Hand the arena block back to smalloc as an empty CHUNK block
+void sarena_end(struct SARENA* arena) {
+    SMALLOC_LOCK();
+    __release_block(arena->block);
+    SMALLOC_UNLOCK();
+}
@@ -0,0 +1,38 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+#ifndef __SARENA_H
+#define __SARENA_H
+
+// An arena (region) of scratch memory in a single smalloc BLOCK.
+// Allocations are bumped out of the block with no per-allocation header,
+// and all of them are released at once by sarena_reset.
+struct SARENA;
+
+// create an arena with at least size bytes of space
+// returns NULL if there is not enough memory
+struct SARENA *sarena_begin(unsigned long size);
+// allocate n bytes from the arena, NULL if the arena is full
+void *sarena_alloc(struct SARENA*, unsigned long n);
+// release everything allocated from the arena, in O(1)
+void sarena_reset(struct SARENA*);
+// release the arena; its block becomes ordinary smalloc space
+void sarena_end(struct SARENA*);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,191 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+#include "shandle.h"
+#include "smalloc.h"
+#include "spool.h"
+#include "smalloc_internal.h"
+
+/*
+  "shandle" - relocatable memory behind handles
+
+- A handle is the address of a master pointer (struct SMASTER), which points
+  to the memory. Master pointers come from a spool, so they never move. The
+  spool is given back when its last handle is freed, so it is never left
+  behind in a heap that __smalloc_init has since started over.
+- The memory is an ordinary smalloc CHUNK whose payload starts with a pointer
+  back to its master, followed by the caller's bytes. A CHUNK is a handle's
+  when that back pointer leads to a slot of the masters' spool that points
+  right back at it -- plain memory can look like that, a spool slot can't.
+- Compaction works on the default heap, one block at a time, and moves only
+  unlocked handle memory. In each block, a handle CHUNK right after a free
+  CHUNK slides down over it (__slide_chunk), so the free space gathers at the
+  block's top. When the last block holds nothing but unlocked handles, they are
+  moved into free space below it (__lower_chunk) and the empty block is given back.
+- Handles are not locked (SMALLOC_SAFE) beyond the heap itself; use them from
+  one context, like a spool.
+*/
+
+struct SMASTER {
+    void* ptr;                  // the memory, first so that a handle is a void**
+    unsigned locks;             // the memory moves only when this is 0
+};
+
+#define HANDLE_PREFIX       ALIGN_UP(sizeof(struct SMASTER *), SMALLOC_ALIGN)
+#define MASTERS_PER_BLOCK   64
+
+static struct SPOOL* __masters = NULL;
+static SIZE_T __handles = 0;                    // handles allocated from __masters
+static struct BLOCK* __compact_cursor = NULL;   // where the next compaction step starts
+
+// Give a master back, and the spool too once no handle is left
+static void __free_master(struct SMASTER* master) {
+    spool_free(__masters, master);
+    if(--__handles) return;
+    spool_destroy(__masters);
+    __masters = NULL;
+}
+
+void **shandle_alloc(SIZE_T n) {
+    if(!__masters) __masters = spool_create(sizeof(struct SMASTER), MASTERS_PER_BLOCK);
+    if(!__masters) return NULL;
+    struct SMASTER* master = spool_alloc(__masters);
+    if(!master) return NULL;
+
+    __handles++;
+
+    void* ptr = n <= (SIZE_T)-1 - HANDLE_PREFIX ? smalloc(n + HANDLE_PREFIX) : NULL;
+    if(!ptr) {
+        __free_master(master);
+        return NULL;
+    }
+    *(struct SMASTER **)ptr = master;
+    master->ptr = ptr + HANDLE_PREFIX;
+    master->locks = 0;
+    return &master->ptr;
+}
+
+void shandle_free(void **handle) {
+    if(!handle) return;
+    struct SMASTER* master = (struct SMASTER *)handle;
+    void* ptr = master->ptr - HANDLE_PREFIX;
+    *(struct SMASTER **)ptr = NULL; // no longer a handle's
+    sfree(ptr);
+    __free_master(master);
+}
+
+void *shandle_lock(void **handle) {
+    struct SMASTER* master = (struct SMASTER *)handle;
+    SMALLOC_LOCK();
+    master->locks++;
+    void* ptr = master->ptr;
+    SMALLOC_UNLOCK();
+    return ptr;
+}
+
+void shandle_unlock(void **handle) {
+    struct SMASTER* master = (struct SMASTER *)handle;
+    SMALLOC_LOCK();
+    if(master->locks) master->locks--;
+    SMALLOC_UNLOCK();
+}
+
+// The master of an unlocked handle's CHUNK, or NULL
+// lo .. hi is the heap's block space, which holds the masters' spool
+static struct SMASTER* __movable(struct CHUNK* chunk, void* lo, void* hi) {
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD) || !__masters) return NULL;
+    void* ptr = (void *)chunk + CHUNK_HEADER_SZ;
+    struct SMASTER* master = *(struct SMASTER **)ptr;
+    if((void *)master < lo || (void *)(master + 1) > hi || !spool_owns(__masters, master)) return NULL;
+    if(master->ptr != ptr + HANDLE_PREFIX || master->locks) return NULL;
+    return master;
+}
+
+// Slide the handles in a block down over the free space in front of them
+static SIZE_T __compact_block(struct BLOCK* block, SIZE_T budget, void* lo, void* hi) {
+    SIZE_T moved = 0;
+    struct CHUNK* chunk = (void *)block + BLOCK_HEADER_SZ;
+    while((void *)chunk < block->top && moved < budget) {
+        struct SMASTER* master;
+        if((CHUNK_FLAGS(chunk) & PREVFREE) && (master = __movable(chunk, lo, hi))) {
+            void* ptr = __slide_chunk((void *)chunk + CHUNK_HEADER_SZ);
+            master->ptr = ptr + HANDLE_PREFIX;
+            chunk = ptr - CHUNK_HEADER_SZ;
+            moved += CHUNK_SIZE(chunk);
+        }
+        chunk = (void *)chunk + CHUNK_SIZE(chunk);
+    }
+    return moved;
+}
+
+// Move the handles out of the last block, if nothing else is in it
+static SIZE_T __empty_block(struct BLOCK* block, SIZE_T budget, void* lo, void* hi) {
+    for(struct CHUNK* chunk = (void *)block + BLOCK_HEADER_SZ; (void *)chunk < block->top;
+        chunk = (void *)chunk + CHUNK_SIZE(chunk)) {
+        if((CHUNK_FLAGS(chunk) & ALLOCD) && !__movable(chunk, lo, hi)) return 0; // pinned
+    }
+
+    SIZE_T moved = 0;
+    while(moved < budget && block->top > (void *)block + BLOCK_HEADER_SZ) {
+        // freeing the old chunk can merge it with its neighbours (or release
+        // the block), so look for the next handle from the start each time
+        struct CHUNK* chunk = (void *)block + BLOCK_HEADER_SZ;
+        while(!(CHUNK_FLAGS(chunk) & ALLOCD)) chunk = (void *)chunk + CHUNK_SIZE(chunk);
+        struct SMASTER* master = __movable(chunk, lo, hi);
+        SIZE_T size = CHUNK_SIZE(chunk);
+        // free chunks are never adjacent, so at most one can follow the last handle
+        struct CHUNK* after = (void *)chunk + size;
+        if((void *)after < block->top && !(CHUNK_FLAGS(after) & ALLOCD)) after = (void *)after + CHUNK_SIZE(after);
+        int only = (void *)after == block->top;
+
+        void* ptr = __lower_chunk((void *)chunk + CHUNK_HEADER_SZ, block);
+        if(!ptr) break; // no room below
+        master->ptr = ptr + HANDLE_PREFIX;
+        moved += size;
+        if(only) break; // the block was emptied and given back
+    }
+    return moved;
+}
+
+SIZE_T __smalloc_compact(SIZE_T budget) {
+#ifdef SMALLOC_DEFER
+    __smalloc_drain();
+#endif
+    SIZE_T moved = 0;
+    SMALLOC_LOCK();
+    struct BLOCK* first = __heap_first_block();
+    struct BLOCK* last = first;
+    struct BLOCK* block = first;
+    for(struct BLOCK* b = first; b; b = b->next) {
+        if(b == __compact_cursor) block = b;
+        last = b;
+    }
+    if(first) {
+        void* lo = first;
+        void* hi = (void *)last + last->size;
+        for(; block && moved < budget; block = block->next) {
+            if(block->kind == BLOCK_CHUNKS) moved += __compact_block(block, budget - moved, lo, hi);
+            if(moved >= budget) break;
+        }
+        if(!block && last->kind == BLOCK_CHUNKS) moved += __empty_block(last, budget - moved, lo, hi);
+    }
+    // carry on from this block next time, or start over after a full pass
+    __compact_cursor = block;
+    SMALLOC_UNLOCK();
+    return moved;
+}
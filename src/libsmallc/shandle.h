@@ -0,0 +1,43 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+#ifndef __SHANDLE_H
+#define __SHANDLE_H
+
+// Relocatable allocations: a handle points to a master pointer, which points
+// to the memory. The memory may move while it is unlocked (see __smalloc_compact),
+// so keep the handle and dereference it again after anything that compacts.
+
+// allocate n bytes of relocatable memory from the heap, *handle is its address
+// returns NULL if there is not enough memory
+void **shandle_alloc(unsigned long n);
+// release the memory and the handle
+void shandle_free(void **handle);
+// pin the memory in place and return its address; locks nest
+void *shandle_lock(void **handle);
+// undo one shandle_lock, the memory can move again once it is fully unlocked
+void shandle_unlock(void **handle);
+
+// one step of compaction: slide unlocked handle memory down over the free
+// space in front of it, and move it out of the last block so that block can
+// be given back. Stops once about budget bytes have been moved; the next call
+// carries on from there.
+// returns the bytes moved, 0 when there is nothing left to do
+unsigned long __smalloc_compact(unsigned long budget);
+
+#endif
\ No newline at end of file
@@ -18,6 +18,10 @@ IN THE SOFTWARE.
 */
 
 #include "smalloc.h"
+#include "smalloc_internal.h"
+#include "memcpy.h"
+#include "memmove.h"
+#include "memset.h"
 
 /*
   "smalloc" - simple memory allocator for non-mmu machines
@@ -27,213 +31,1722 @@ IN THE SOFTWARE.
   we stand on the shoulders of giants.
 
 - Heap starts at specific address, HEAP_BOTTOM
-- Heap grows in BLOCK units. Each block provides memory and
-  maintains a list of freed memory out of itself.
+- Heap grows in BLOCK units. Each block provides memory for CHUNKs,
+  or is handed whole to another allocator (see spool.c, sarena.c).
 - Blocks are PAGESIZE units by default, but a block can
   be allocated to an arbitrarily large size.
 - Blocks are a doubly-linked list.
 - Freed (released) memory is enqueued as a CHUNK-like structure, FREED,
-  that can be searched on subsequent allocations for reuse.
+  into a size-class "bin" that can be searched on subsequent allocations for reuse.
+- Bins are global: small chunks are binned by exact size, larger chunks by
+  power of two. A bitmap of non-empty bins keeps the search near-constant.
+  Each large bin is a size-ordered trie, so large requests get the best fit.
+- Freed chunks carry a boundary tag (their size, in their last word) so that
+  sfree can coalesce a chunk with its free physical neighbours in O(1).
+  Free space next to a block's top is given back to the block.
+- A freed chunk larger than needed is split, and the remainder goes back
+  into its bin.
 - We try to find a freed chunk of memory first, then a
   block with enough remaining space, and then finally,
   allocate a new block that can accomodate the requested size.
+- smalloc_hint allocations are short-lived or long-lived (plain smalloc).
+  Each lifetime has its own bins and its own blocks, a "lane", so short-lived
+  chunks don't end up between long-lived ones; a block's chunks are binned
+  in its lifetime's lane. An empty block can change lanes when the heap is full.
+- smalloc_near looks for room next to an allocation, in its block or the
+  blocks on either side, before it does what smalloc does.
+- Built with SMALLOC_BANK, a block whose chunks would straddle a bank
+  boundary is moved up to it, and the block before grows over the gap.
+- Blocks with room at the top are indexed by how much room they have, one
+  list per power of two plus a bitmap, so finding one doesn't walk the heap.
+  Full blocks (and spool/sarena blocks) are not indexed at all.
+- A block whose chunks have all been freed is back to pristine: coalescing
+  gives everything to its top. Empty blocks at the end of the list are
+  released, moving the heap frontier back down.
+- Every CHUNK, BLOCK and chunk size is a multiple of SMALLOC_ALIGN, so every
+  pointer handed out is aligned. saligned_alloc over-allocates and splits
+  off the leading and trailing space for larger alignments.
+- srealloc resizes in place when it can: shrinking splits the chunk, and
+  growing takes space from the block's top or from a free next chunk.
+- Built with SMALLOC_SAFE, the public entry points take a pluggable lock
+  around all heap state (IRQ-disable on bare metal, a mutex when hosted),
+  and each context (task, IRQ level, thread) can have a small cache of
+  recently freed small chunks that smalloc/sfree use without the lock.
+- With SMALLOC_DEFER, sfree only pushes the chunk onto its heap's pending
+  stack. The pending chunks are binned (and coalesced) together on the next
+  allocation that reaches the heap, or by __smalloc_drain.
+- Built with SMALLOC_RT, the few loops that can run as long as the heap is
+  big (releasing a run of empty blocks, adopting one, draining pending
+  frees) have a fixed budget, so smalloc and sfree are bounded.
+- Heap statistics are counters kept up to date as blocks, bins and block
+  tops change, so the statistics calls don't walk the heap.
+- Built with SMALLOC_DEBUG, chunks carry a magic word and the requested
+  size, the space past a request is filled with canary bytes, freed
+  memory is poisoned, and sfree/srealloc check a pointer (magic, canary,
+  and that its block is in the list) before touching the heap.
+  __smalloc_check walks and verifies the whole heap.
+- Built with SMALLOC_TRACE, every smalloc/srealloc/sfree is recorded in a
+  ring buffer of records (16 bytes with 32-bit pointers, 24 with 64-bit)
+  that can be dumped and replayed on a host.
+- Built with SMALLOC_COMPACT, a CHUNK header is one word (the size, with
+  the flags in its low bits). The block a chunk is in is looked up in a
+  pagemap, kept at HEAP_BOTTOM, of the block each page-sized span of
+  the heap starts in; blocks are at least a page, so the chunk is in that
+  block or the next one.
+- All of a heap's state is in a struct SHEAP. smalloc uses a default heap,
+  sheap_init makes others in other memory ranges (e.g. fast RAM), and
+  sfree/srealloc find the heap a pointer belongs to by its address.
 - If we cannot allocate memory within the boundaries (HEAP_BOTTOM, HEAP_TOP)
   we return NULL -- no more memory.
 - There is no sbrk.
 
 TODO:
  - Coalesce freed large blocks -- maybe not important?
- - Coalesce freed chunks to form larger available chunks for reallocations
- - Reasonably split freed memory chunks to form new utilized chunks
- - Debug or general memory testing to detect bad memory frees
  - Simplify / reduce the overhead
 */
 
-#ifndef NULL
-#define NULL 0
-#endif
+// Freed chunks are kept in size-class bins, dlmalloc style:
+// - small bins hold chunks of exactly (index * BIN_GRANULE) bytes
+// - tree bins hold chunks in [SMALL_LIMIT << n, SMALL_LIMIT << (n+1))
+//   and the last tree bin holds everything bigger
+// Chunk sizes are multiples of the alignment so small bins are exact.
+// Each tree bin is a bitwise trie on chunk size (dlmalloc's treebins), so the
+// best fit for a large request is found in O(log n) steps.
+#define BIN_GRANULE                SMALLOC_ALIGN
+#define SMALL_BINS                 32
+#define TREE_BINS                  24
+#define SMALL_LIMIT                (SMALL_BINS * BIN_GRANULE)
+
+// smallest chunk that can be freed: a FREED and its footer
+#define MIN_CHUNK_SZ               ALIGN_UP(sizeof(struct FREED) + sizeof(SIZE_T), SMALLOC_ALIGN)
 
-#undef SIZE_T
-#define SIZE_T unsigned long
+// struct TFREED is a FREED of at least SMALL_LIMIT bytes, in a tree bin.
+// Chunks of the same size hang off the tree node in a list through
+// freed.next/prev; only the first of them is in the tree (its prev is NULL).
+struct TFREED {
+    struct FREED freed;
+    struct TFREED* child[2];        // child[b] holds sizes with b at the next bit
+    struct TFREED* parent;          // NULL at the root of the bin
+    unsigned index;                 // the tree bin
+};
 
-// The heap starts at HEAP_BOTTOM and grows by PAGESIZE,
-// and _never_ past HEAP_TOP
-static void* HEAP_BOTTOM = (void*)0x050000;
-static void* HEAP_TOP = (void*)0x07ffff;
-static SIZE_T PAGESIZE = 8192;
+// CHUNK blocks with at least MIN_CHUNK_SZ remaining, by room:
+// rooms[n] holds blocks with remaining in [1 << n, 1 << (n+1))
+#define ROOMS                      (sizeof(unsigned long) * 8)
+#define ROOM_PROBES                8   // blocks tried in a room that may not fit
+#define NEAR_PROBES                32  // chunks after an allocation tried by smalloc_near
 
-#define ALLOCD 1
+// Built with SMALLOC_RT, the loops that are otherwise bounded only by the
+// size of the heap (or by how much has been freed) get a fixed budget instead
+#ifdef SMALLOC_RT
+#define RT_RELEASE                 1   // empty blocks released by one sfree
+#define RT_ADOPT                   ROOM_PROBES // empty blocks of another lifetime looked at
+#define RT_DRAIN                   4   // pending chunks binned by one allocation
+#define RT_DEFER_PROBES            8   // pending chunks a deferred sfree checks for a double free
+#endif
 
-// struct CHUNK is the header of a non-free and free allocation
-// within a block. if CHUNK is at memory M, the "user" (program)
-// receives the address to memory, M + sizeof(struct CHUNK).
-struct CHUNK {
-    void *block;
-    SIZE_T size;    // total size, inclusive of the CHUNK header
-    unsigned flags; 
+// struct SLANE is the freed chunks and the blocks with room of one lifetime
+// (SMALLOC_LONG, SMALLOC_SHORT); a block's chunks are all in its lifetime's lane
+struct SLANE {
+    struct FREED* smallBins[SMALL_BINS];
+    struct TFREED* treeBins[TREE_BINS];
+    unsigned long smallMap;             // bit i set => smallBins[i] is not empty
+    unsigned long treeMap;              // bit i set => treeBins[i] is not empty
+    struct BLOCK* rooms[ROOMS];
+    unsigned long roomMap;              // bit i set => rooms[i] is not empty
 };
 
-// struct FREED is a struct CHUNK + pointers to maintain
-// a doubly-linked list of free CHUNKs - the pointers live
-// in what was the program data area.
-// This data structure defines the minimum allocatable
-// size of any CHUNK returned by smalloc.
-struct FREED {
-    struct CHUNK header;
-    struct FREED* next;
-    struct FREED* prev;
+// struct SHEAP is everything smalloc knows about one heap
+// The heap starts at bottom and grows by pageSize, and _never_ past top.
+struct DEFERRED;
+
+struct SHEAP {
+    struct SHEAP* next;                 // the other heaps, for finding the heap of a pointer
+    void* base;                         // the heap's memory: its SHEAP and pagemap, if any, then bottom
+    void* bottom;
+    void* top;                          // the last byte of the heap
+    SIZE_T pageSize;
+    struct BLOCK* first;
+    struct BLOCK* last;
+    struct SLANE lanes[LIFETIMES];
+    struct SMALLOC_STATS stats;         // inUse is derived from the others when it is asked for
+    SIZE_T otherBlocks;                 // blocks claimed by a spool or sarena
+    int (*commit)(void*, SIZE_T);       // the page source, if memory must be committed before use
+    void (*release)(void*, SIZE_T);
+    void* committed;                    // usable memory ends here, when there is a page source
+    void* zeroed;                       // the memory from here to top is known to be zero
+#ifdef SMALLOC_DEFER
+    struct DEFERRED* volatile deferred; // chunks sfree'd but not yet given back
+#ifdef SMALLOC_RT
+    struct DEFERRED* draining;          // pending chunks taken off deferred, binned RT_DRAIN at a time
+#endif
+#endif
+#ifdef SMALLOC_COMPACT
+    // pagemap[i] is the block that holds bottom + (i << pageShift)
+    // the span, 1 << pageShift, is the largest power of two up to pageSize
+    struct BLOCK** pagemap;
+    unsigned pageShift;
+#endif
 };
 
-// struct BLOCK maintains a doubly-linked list of BLOCKs
-// It also maintains a pointer, top, to the next memory space to allocate the next chunk in itself.
-// It maintains a pointer to the head of a doubly-linked list of freed chunks.
-// It maintains some size information to make new allocations and reporting easy.
-struct BLOCK {
-    struct BLOCK* prev;             // previous block, i.e., towards __first_block
-    struct BLOCK* next;             // next block, i.e., towards __last_block
-    SIZE_T size;                    // size of the entire block: header and space for CHUNKs
-    SIZE_T remaining;               // remaining bytes that can be allocated by smalloc in block
-    void*  top;                     // where to start allocating new smalloc requests
-    struct FREED* free;             // recycling is important
+// smalloc and friends use the default heap; __smalloc_init sets it up
+static struct SHEAP __default_heap = {
+    .base = (void*)0x050000,
+    .bottom = (void*)0x050000,
+    .top = (void*)0x07ffff,
+    .pageSize = 8192,
 };
-// 24-byte header on 8K default allocation size is 0.3% overhead
+static struct SHEAP* __heaps = &__default_heap;
+
+// The heap that __smalloc_stats, __smalloc_check and the other diagnostics look at
+static struct SHEAP* __diagnosed = &__default_heap;
+
+// The heap every internal function works on. It is the default heap except
+// while a call for another heap holds the lock.
+static struct SHEAP* __heap = &__default_heap;
+
+// The lifetime new chunks and blocks are for. It is SMALLOC_LONG except
+// while smalloc_hint (or srealloc moving a chunk) holds the lock.
+static unsigned __lifetime = SMALLOC_LONG;
 
-#define BLOCK_HEADER_SZ            (sizeof(struct BLOCK))
+// the current heap's state, by the names it had when there was only one heap
+#define HEAP_BOTTOM                (__heap->bottom)
+#define HEAP_TOP                   (__heap->top)
+#define PAGESIZE                   (__heap->pageSize)
+#define __first_block              (__heap->first)
+#define __last_block               (__heap->last)
+#define __lane                     (__heap->lanes[__lifetime])
+#define __stats                    (__heap->stats)
+#define __other_blocks             (__heap->otherBlocks)
+#define __pagemap                  (__heap->pagemap)
+#define __page_shift               (__heap->pageShift)
+#define __deferred                 (__heap->deferred)
+#define __draining                 (__heap->draining)
+#define __commit                   (__heap->commit)
+#define __release                  (__heap->release)
+#define __committed                (__heap->committed)
+#define __zeroed                   (__heap->zeroed)
 
-struct BLOCK* __first_block = NULL;
-struct BLOCK* __last_block = NULL;
+// make heap the current heap until LEAVE_HEAP() -- with the lock held
+#define ENTER_HEAP(heap)           struct SHEAP* __previousHeap = __heap; __heap = (heap)
+#define LEAVE_HEAP()               __heap = __previousHeap
 
-struct FREED* __use_freed_chunk(SIZE_T minSize, SIZE_T maxSize);
+// the lane a chunk or block is binned and indexed in
+#define CHUNK_LANE(chunk)          (__heap->lanes[CHUNK_BLOCK((struct CHUNK *)(chunk))->lifetime])
+#define BLOCK_LANE(block)          (__heap->lanes[(block)->lifetime])
+
+#define STATS_IN_USE()  (__stats.heap - __stats.inOthers - __stats.untouched - __stats.inFree \
+                        - (__stats.blocks - __other_blocks) * BLOCK_HEADER_SZ)
+
+void __tree_insert(struct TFREED* node);
+void __tree_unlink(struct TFREED* node);
+struct TFREED* __tree_best_fit(SIZE_T minSize);
+void __bin_insert(struct FREED* freed);
+void __bin_unlink(struct FREED* freed);
+struct FREED* __use_freed_chunk(SIZE_T minSize);
 struct BLOCK* __block_with_free_space(SIZE_T size);
-struct BLOCK* __new_block(SIZE_T requestedSize);
+struct BLOCK* __adopt_empty_block(SIZE_T size);
+void __room_insert(struct BLOCK* block);
+void __room_unlink(struct BLOCK* block);
+void __set_remaining(struct BLOCK* block, SIZE_T remaining);
+void __release_trailing_blocks(void);
+SIZE_T __chunk_size(SIZE_T n);
+void* __smalloc(SIZE_T n);
+void* __scalloc(SIZE_T n);
+void* __smalloc_near(void* near, SIZE_T n);
+SIZE_T __smalloc_n(SIZE_T n, SIZE_T count, void* out[]);
+void __sfree_run(struct CHUNK* first, SIZE_T size, SIZE_T chunks);
+void* __saligned_alloc(SIZE_T align, SIZE_T n);
+void* __srealloc(void *ptr, SIZE_T n);
+void __sfree(void *ptr);
+#ifdef SMALLOC_DEFER
+static void __drain(SIZE_T budget);
+#endif
+static void* __page_end(void* end);
+static int __commit_to(void* end);
+#ifdef SMALLOC_COMPACT
+static struct BLOCK* __heap_block_of(struct SHEAP* heap, void* ptr);
+#endif
+
+// Set up the current heap in the memory from bottom to top
+// returns 0 if the memory can't hold a block; the heap then has no memory at all
+static int __heap_init(SIZE_T bottom, SIZE_T top, SIZE_T pageSize) {
+    // whatever the heap held is forgotten first, so a failed init leaves nothing stale
+    __heap->base = NULL;
+    HEAP_BOTTOM = NULL;
+    HEAP_TOP = NULL;
+    __committed = NULL;
+    __zeroed = NULL;
+    __first_block = NULL;
+    __last_block = NULL;
+    for(unsigned i = 0; i < LIFETIMES; i++) __heap->lanes[i] = (struct SLANE){ 0 };
+    __stats = (struct SMALLOC_STATS){ 0 };
+    __other_blocks = 0;
+#ifdef SMALLOC_DEFER
+    __deferred = NULL;
+#ifdef SMALLOC_RT
+    __draining = NULL;
+#endif
+#endif
 
-// tuning / configuration of the heap space in
-// physical memory
-void __smalloc_init(SIZE_T bottom, SIZE_T top, SIZE_T pageSize) {
     // guard to prevent a really unfortunate init call
-    if(bottom > top || top - bottom < pageSize) return;
+    bottom = ALIGN_UP(bottom, SMALLOC_ALIGN);
+    if(bottom > top || top - bottom < pageSize) return 0;
+    void* base = (void*)bottom;
 
+#ifdef SMALLOC_COMPACT
+    // the pagemap takes the bottom of the heap, one entry per span up to top
+    unsigned shift = 0;
+    while((2UL << shift) <= pageSize) shift++;
+    SIZE_T mapSize = (((top - bottom) >> shift) + 1) * sizeof(struct BLOCK*);
+    mapSize = ALIGN_UP(mapSize, SMALLOC_ALIGN);
+    if(top - bottom < mapSize + pageSize) return 0;
+    if(__commit && !__commit((void *)bottom, mapSize)) return 0;
+    __pagemap = (struct BLOCK**)bottom;
+    __page_shift = shift;
+    bottom += mapSize;
+#endif
+    __heap->base = base;
     HEAP_BOTTOM = (void*)bottom;
     HEAP_TOP = (void*)top;
     PAGESIZE = pageSize;
-    __first_block = NULL;
-    __last_block = NULL;
+    __committed = (void*)bottom;
+    __zeroed = (void*)top + 1; // nothing, until __smalloc_set_zeroed
+    return 1;
 }
 
-// TODO: alignment! (we may generate unaligned pointers!)
-void* smalloc(SIZE_T n) {
-    // We allocate requested size, n, plus CHUNK header size
-    SIZE_T allocSize = n + sizeof(struct CHUNK);
+// tuning / configuration of the heap space in
+// physical memory
+int __smalloc_init(SIZE_T bottom, SIZE_T top, SIZE_T pageSize) {
+    SMALLOC_LOCK();
+    int ok = __heap_init(bottom, top, pageSize);
+    SMALLOC_UNLOCK();
+    return ok;
+}
+
+void __smalloc_set_pages(int (*commit)(void*, SIZE_T), void (*release)(void*, SIZE_T)) {
+    SMALLOC_LOCK();
+    __default_heap.commit = commit;
+    __default_heap.release = release;
+    SMALLOC_UNLOCK();
+}
+
+void __smalloc_set_zeroed(void) {
+    SMALLOC_LOCK();
+    ENTER_HEAP(&__default_heap);
+    __zeroed = __last_block ? (void *)__last_block + __last_block->size : HEAP_BOTTOM;
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+}
+
+// Make a heap of the memory from bottom to top; its struct SHEAP takes the bottom
+// returns NULL if the memory is too small, or any of it is another heap's
+struct SHEAP* sheap_init(SIZE_T bottom, SIZE_T top, SIZE_T pageSize) {
+    bottom = ALIGN_UP(bottom, SMALLOC_ALIGN);
+    if(bottom > top || top - bottom < sizeof(struct SHEAP)) return NULL;
+    struct SHEAP* heap = (struct SHEAP*)bottom;
+    SMALLOC_LOCK();
+    int ok = 1;
+    for(struct SHEAP* other = __heaps; other && ok; other = other->next) {
+        ok = !other->base || (void*)top < other->base || (void*)bottom > other->top;
+    }
+    if(ok) {
+        heap->commit = NULL;
+        heap->release = NULL;
+        ENTER_HEAP(heap);
+        ok = __heap_init(bottom + sizeof(struct SHEAP), top, pageSize);
+        LEAVE_HEAP();
+    }
+    if(ok) {
+        heap->base = heap;
+        heap->next = __heaps;
+        __heaps = heap;
+    }
+    SMALLOC_UNLOCK();
+    return ok ? heap : NULL;
+}
+
+// Forget a heap; its memory (and everything in it) is the caller's again
+void sheap_destroy(struct SHEAP* heap) {
+    if(heap == &__default_heap) return;
+    SMALLOC_LOCK();
+    for(struct SHEAP** link = &__heaps; *link; link = &(*link)->next) {
+        if(*link == heap) {
+            *link = heap->next;
+            break;
+        }
+    }
+    if(__diagnosed == heap) __diagnosed = &__default_heap;
+    SMALLOC_UNLOCK();
+}
+
+// Find the heap that ptr was allocated from, or NULL
+static struct SHEAP* __heap_of(void* ptr) {
+    struct SHEAP* heap = __heaps;
+    while(heap && (ptr < heap->bottom || ptr > heap->top)) heap = heap->next;
+    return heap;
+}
 
-    // The minimum allocation size is actually sizeof(struct FREED) --
+// Book-keeping for a successful allocation, or an allocation that grew
+static void __note_peak(void) {
+    SIZE_T inUse = STATS_IN_USE();
+    if(inUse > __stats.peakInUse) __stats.peakInUse = inUse;
+}
+
+static void __count_alloc(void) {
+    __stats.allocations++;
+    __stats.live++;
+    __note_peak();
+}
+
+// The chunk size for an n-byte request, or 0 if n is impossibly large
+SIZE_T __chunk_size(SIZE_T n) {
+    if(n > (SIZE_T)(HEAP_TOP - HEAP_BOTTOM)) return 0;
+
+    // We allocate requested size, n, plus CHUNK header size (and a canary when debugging)
+    // rounded up to the alignment, so the next chunk is aligned too
+    SIZE_T allocSize = ALIGN_UP(n + CHUNK_HEADER_SZ + CANARY_SZ, SMALLOC_ALIGN);
+
+    // The minimum allocation size is actually MIN_CHUNK_SZ --
     // We need the space for enqueueing the allocated chunk of memory
-    // into the "free" list -- when it is freed.
-    if(allocSize < sizeof(struct FREED)) allocSize = sizeof(struct FREED);
+    // into the "free" list, plus its footer -- when it is freed.
+    if(allocSize < MIN_CHUNK_SZ) allocSize = MIN_CHUNK_SZ;
     // BTW this ensures that we are allocating more than 0 bytes
+    return allocSize;
+}
 
-    // reallocate previously freed memory, if possible
-    // we allow reuse of chunks of allocSize, up to allocSize*2
-    SIZE_T doubleSize = allocSize << 1;
-    struct FREED* freed = __use_freed_chunk(allocSize, doubleSize);
-    if(freed) {
-        struct CHUNK* chunk = (struct CHUNK *)freed;
-        chunk->flags |= ALLOCD;
-        return (void*)chunk + sizeof(struct CHUNK);
-    }
+static void* __take_freed(struct FREED* freed, SIZE_T allocSize);
 
-    // Find a block with enough unused space for the requested size
+// Reallocate previously freed memory for a chunk of allocSize, if possible
+// a larger chunk is split and the remainder goes back into a bin
+static void* __reuse_freed(SIZE_T allocSize) {
+#ifdef SMALLOC_DEFER
+    // the slow path is where pending frees are finally binned
+#ifdef SMALLOC_RT
+    if(__deferred || __draining) __drain(RT_DRAIN);
+#else
+    if(__deferred) __drain((SIZE_T)-1);
+#endif
+#endif
+
+    struct FREED* freed = __use_freed_chunk(allocSize);
+    if(!freed) return NULL;
+    return __take_freed(freed, allocSize);
+}
+
+// Allocate a chunk of allocSize from a freed chunk that is out of its bin
+static void* __take_freed(struct FREED* freed, SIZE_T allocSize) {
+    struct CHUNK* chunk = (struct CHUNK *)freed;
+    SET_FLAGS(chunk, ALLOCD);
+    // a free chunk is never the last one before top, so next is a chunk
+    struct CHUNK* next = (void *)chunk + CHUNK_SIZE(chunk);
+    CLEAR_FLAG(next, PREVFREE);
+    __trim_chunk(chunk, allocSize);
+    __count_alloc();
+    return (void*)chunk + CHUNK_HEADER_SZ;
+}
+
+// Find a block of the current lifetime with enough unused space for a chunk of allocSize
+static struct BLOCK* __block_for(SIZE_T allocSize) {
     struct BLOCK* block = __block_with_free_space(allocSize);
     if(!block) {
         // No existing block exists, so create a new block with enough size.
         block = __new_block(allocSize);
     }
+    if(!block) {
+        // The heap is full; an empty block of another lifetime will do.
+        block = __adopt_empty_block(allocSize);
+    }
+    return block;
+}
 
-    if(!block) return NULL; // out of memory
-
-    // Allocate a chunk from the block
+// Allocate a chunk of allocSize from the top of a block with room for it
+static void* __carve_chunk(struct BLOCK* block, SIZE_T allocSize) {
     struct CHUNK* chunk = block->top;
     block->top += allocSize;
-    block->remaining -= allocSize;
-    chunk->block = block;
-    chunk->size = allocSize;
-    chunk->flags = (ALLOCD);
-    return (void *)chunk + sizeof(struct CHUNK);
+    __set_remaining(block, block->remaining - allocSize);
+    SET_BLOCK(chunk, block);
+    SET_SIZE(chunk, allocSize);
+    SET_FLAGS(chunk, ALLOCD);
+    __count_alloc();
+    return (void *)chunk + CHUNK_HEADER_SZ;
+}
+
+void* __smalloc(SIZE_T n) {
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize) return NULL;
+
+    void* ptr = __reuse_freed(allocSize);
+    if(ptr) return ptr;
+
+    struct BLOCK* block = __block_for(allocSize);
+    if(!block) return NULL; // out of memory
+    return __carve_chunk(block, allocSize);
+}
+
+// Allocate n bytes as close to the allocation near as the heap allows: the free
+// chunk in front of it, one of the next few chunks after it, the top of its block,
+// the top of a block next to it, and then wherever smalloc would.
+// The memory has near's lifetime.
+void* __smalloc_near(void* near, SIZE_T n) {
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize) return NULL;
+    struct CHUNK* chunk = near - CHUNK_HEADER_SZ;
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD)) return __smalloc(n); // ruh-roh
+    struct BLOCK* block = CHUNK_BLOCK(chunk);
+
+    if(CHUNK_FLAGS(chunk) & PREVFREE) {
+        struct CHUNK* prev = (void *)chunk - *(SIZE_T *)((void *)chunk - sizeof(SIZE_T));
+        if(CHUNK_SIZE(prev) >= allocSize) {
+            __bin_unlink((struct FREED *)prev);
+            return __take_freed((struct FREED *)prev, allocSize);
+        }
+    }
+    struct CHUNK* next = (void *)chunk + CHUNK_SIZE(chunk);
+    for(unsigned probes = 0; (void *)next < block->top && probes < NEAR_PROBES; probes++) {
+        if(!(CHUNK_FLAGS(next) & ALLOCD) && CHUNK_SIZE(next) >= allocSize) {
+            __bin_unlink((struct FREED *)next);
+            return __take_freed((struct FREED *)next, allocSize);
+        }
+        next = (void *)next + CHUNK_SIZE(next);
+    }
+    if(block->remaining >= allocSize) return __carve_chunk(block, allocSize);
+    struct BLOCK* other = block->next;
+    if(other && other->kind == BLOCK_CHUNKS && other->lifetime == block->lifetime && other->remaining >= allocSize) {
+        return __carve_chunk(other, allocSize);
+    }
+    other = block->prev;
+    if(other && other->kind == BLOCK_CHUNKS && other->lifetime == block->lifetime && other->remaining >= allocSize) {
+        return __carve_chunk(other, allocSize);
+    }
+
+    unsigned lifetime = __lifetime;
+    __lifetime = block->lifetime;
+    void* ptr = __smalloc(n);
+    __lifetime = lifetime;
+    return ptr;
+}
+
+// Allocate n zeroed bytes
+// Recycled memory is cleared, but a chunk carved from a block's top is only
+// cleared below the block's zeroed mark: memory above it has never been used.
+void* __scalloc(SIZE_T n) {
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize) return NULL;
+
+    void* ptr = __reuse_freed(allocSize);
+    if(ptr) {
+        memset(ptr, 0, n);
+        return ptr;
+    }
+
+    struct BLOCK* block = __block_for(allocSize);
+    if(!block) return NULL; // out of memory
+    void* dirty = block->zeroed;
+    ptr = __carve_chunk(block, allocSize);
+    if(dirty > ptr) memset(ptr, 0, (SIZE_T)(dirty - ptr) < n ? (SIZE_T)(dirty - ptr) : n);
+    return ptr;
+}
+
+// Allocate count chunks for n-byte requests into out[]
+// The whole batch is carved from one block's top when a block has room for it
+// (or a new one can be made), so the size, the search and the book-keeping are
+// done once and each object only costs its header. Otherwise it falls back to
+// one __smalloc per object, which can use freed chunks.
+// returns how many were allocated
+SIZE_T __smalloc_n(SIZE_T n, SIZE_T count, void* out[]) {
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize || !count) return 0; // no batch at all: nothing to find a block for
+
+    SIZE_T done = 0;
+    if(count <= (SIZE_T)(HEAP_TOP - HEAP_BOTTOM) / allocSize) {
+        SIZE_T total = allocSize * count;
+        struct BLOCK* block = __block_for(total);
+        if(block) {
+            struct CHUNK* chunk = block->top;
+            block->top += total;
+            __set_remaining(block, block->remaining - total);
+            for(; done < count; done++) {
+                SET_BLOCK(chunk, block);
+                SET_SIZE(chunk, allocSize);
+                SET_FLAGS(chunk, ALLOCD);
+                out[done] = (void *)chunk + CHUNK_HEADER_SZ;
+                chunk = (void *)chunk + allocSize;
+            }
+            __stats.allocations += count;
+            __stats.live += count;
+            __note_peak();
+        }
+    }
+
+    for(; done < count; done++) {
+        out[done] = __smalloc(n);
+        if(!out[done]) break; // out of memory
+    }
+    return done;
+}
+
+#ifdef SMALLOC_SAFE
+unsigned (*__smalloc_lock)(void) = NULL;
+void (*__smalloc_unlock)(unsigned) = NULL;
+SMALLOC_TLS struct SCACHE* __smalloc_context = NULL;
+
+// A cached chunk stays ALLOCD as far as the heap is concerned. Its payload
+// is a struct SCACHED (see smalloc.h), which links it into the cache and
+// remembers the cache, to catch double frees.
+
+// The class of a chunk is the request size class it can always serve
+#define CHUNK_CLASS(chunk)          ((CHUNK_SIZE(chunk) - CHUNK_HEADER_SZ - CANARY_SZ) / SMALLOC_ALIGN)
+
+// SMALLOC_CLASS gives requests smaller than a minimum chunk its class, which
+// smalloc.h works out from the same layout: the same CHUNK header and smallest chunk
+typedef char __smalloc_chunk_sz_agrees[__SMALLOC_CHUNK_SZ == CHUNK_HEADER_SZ ? 1 : -1];
+typedef char __smalloc_min_chunk_agrees[__SMALLOC_MIN_CHUNK == MIN_CHUNK_SZ ? 1 : -1];
+typedef char __smalloc_min_class_agrees[SMALLOC_MIN_CLASS == (MIN_CHUNK_SZ - CHUNK_HEADER_SZ - CANARY_SZ) / SMALLOC_ALIGN ? 1 : -1];
+
+void __smalloc_set_lock(unsigned (*lock)(void), void (*unlock)(unsigned)) {
+    __smalloc_lock = lock;
+    __smalloc_unlock = unlock;
+}
+
+// The caches that have been entered, whose allocations __smalloc_stats adds to
+// the default heap's. Each counts its own, so a cache hit needs no lock.
+static struct SCACHE* __caches = NULL;
+
+struct SCACHE* __smalloc_enter(struct SCACHE* cache) {
+    if(cache && !cache->listed) {
+        SMALLOC_LOCK();
+        cache->next = __caches;
+        cache->listed = 1;
+        __caches = cache;
+        SMALLOC_UNLOCK();
+    }
+    struct SCACHE* previous = __smalloc_context;
+    __smalloc_context = cache;
+    return previous;
+}
+
+// Pop a chunk for an n-byte request from the current context's cache
+static void* __cache_pop(SIZE_T n) {
+    struct SCACHE* cache = __smalloc_context;
+    if(!cache) return NULL;
+    if(n > (SMALLOC_CACHE_CLASSES - 1) * SMALLOC_ALIGN) return NULL;
+    SIZE_T c = SMALLOC_CLASS(n);
+    if(!cache->head[c]) return NULL;
+
+    struct SCACHED* cached = cache->head[c];
+    cache->head[c] = cached->next;
+    cache->count[c]--;
+    cache->allocations++;
+    cached->cache = NULL;
+    return cached;
+}
+
+// Push a freed pointer onto the current context's cache, if it has room
+// returns 0 when the chunk has to go back to the heap instead
+static int __cache_push(void *ptr) {
+    struct SCACHE* cache = __smalloc_context;
+    if(!cache) return 0;
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD)) return 0; // let sfree deal with it
+    SIZE_T c = CHUNK_CLASS(chunk);
+    if(c >= SMALLOC_CACHE_CLASSES || cache->count[c] >= SMALLOC_CACHE_DEPTH) return 0;
+    // short-lived chunks go back to their own blocks rather than to the next smalloc
+#ifdef SMALLOC_COMPACT
+    if(__heap_block_of(&__default_heap, chunk)->lifetime != SMALLOC_LONG) return 0;
+#else
+    if(CHUNK_BLOCK(chunk)->lifetime != SMALLOC_LONG) return 0;
+#endif
+
+    struct SCACHED* cached = ptr;
+    if(cached->cache == cache) {
+        // probably a double free -- but it could be data that looks like a key
+        for(struct SCACHED* other = cache->head[c]; other; other = other->next) {
+            if(other == cached) return 1; // ruh-roh
+        }
+    }
+    cached->next = cache->head[c];
+    cached->cache = cache;
+    cache->head[c] = cached;
+    cache->count[c]++;
+    return 1;
+}
+
+// Give every chunk in a cache back to the heap
+void __smalloc_flush(struct SCACHE* cache) {
+    SMALLOC_LOCK();
+    for(unsigned c = 0; c < SMALLOC_CACHE_CLASSES; c++) {
+        struct SCACHED* cached = cache->head[c];
+        while(cached) {
+            struct SCACHED* next = cached->next;
+            __sfree(cached);
+            cached = next;
+        }
+        cache->head[c] = NULL;
+        cache->count[c] = 0;
+    }
+    // its allocations become the heap's, and it is no longer counted
+    __default_heap.stats.allocations += cache->allocations;
+    cache->allocations = 0;
+    for(struct SCACHE** link = &__caches; *link; link = &(*link)->next) {
+        if(*link == cache) {
+            *link = cache->next;
+            break;
+        }
+    }
+    cache->listed = 0;
+    SMALLOC_UNLOCK();
+}
+#endif
+
+#ifdef SMALLOC_DEFER
+// A deferred chunk stays ALLOCD until it is drained. Its payload links it into
+// its heap's pending stack (in the FREED next field) and remembers the heap,
+// to catch double frees.
+struct DEFERRED {
+    struct DEFERRED* next;
+    struct SHEAP* heap;
+};
+
+// With pointer-sized compare-and-swap the stack is lock-free; otherwise it is
+// pushed and taken with the lock held (e.g. interrupts masked).
+#if defined(__GCC_ATOMIC_POINTER_LOCK_FREE) && __GCC_ATOMIC_POINTER_LOCK_FREE == 2
+#define DEFER_ATOMIC
+#endif
+
+// Is a chunk on its heap's pending stack? Called with the lock held, so the
+// stack can't be drained (and its chunks freed and reused) while it is walked
+// (a real-time build only looks at the most recent frees)
+static int __is_deferred(struct SHEAP* heap, struct DEFERRED* deferred) {
+    unsigned probes = 0;
+    for(struct DEFERRED* other = heap->deferred; other; other = other->next) {
+        if(other == deferred) return 1;
+#ifdef SMALLOC_RT
+        if(++probes == RT_DEFER_PROBES) break;
+#endif
+    }
+    (void)probes;
+    return 0;
+}
+
+// Push a freed pointer onto its heap's pending stack
+static void __defer(struct SHEAP* heap, void* ptr) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD)) return; // ruh-roh
+    struct DEFERRED* deferred = ptr;
+    if(deferred->heap == heap) {
+        // probably a double free -- but it could be data that looks like a key
+        SMALLOC_LOCK();
+        int pending = __is_deferred(heap, deferred);
+        SMALLOC_UNLOCK();
+        if(pending) return; // ruh-roh
+    }
+    deferred->heap = heap;
+#ifdef DEFER_ATOMIC
+    deferred->next = __atomic_load_n(&heap->deferred, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&heap->deferred, &deferred->next, deferred,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#else
+    SMALLOC_LOCK();
+    deferred->next = heap->deferred;
+    heap->deferred = deferred;
+    SMALLOC_UNLOCK();
+#endif
+}
+
+// Take the current heap's pending stack, all at once
+static struct DEFERRED* __take_deferred(void) {
+#ifdef DEFER_ATOMIC
+    return __atomic_exchange_n(&__deferred, NULL, __ATOMIC_ACQUIRE);
+#else
+    struct DEFERRED* deferred = __deferred;
+    __deferred = NULL;
+    return deferred;
+#endif
+}
+
+// Give up to budget of the current heap's pending chunks back to it, with the lock held
+static void __drain(SIZE_T budget) {
+#ifdef SMALLOC_RT
+    // a real-time build works through what it took a few chunks at a time
+    for(; budget; budget--) {
+        if(!__draining) __draining = __take_deferred();
+        if(!__draining) return;
+        struct DEFERRED* next = __draining->next;
+        __sfree(__draining);
+        __draining = next;
+    }
+#else
+    (void)budget;
+    struct DEFERRED* deferred = __take_deferred();
+    while(deferred) {
+        struct DEFERRED* next = deferred->next;
+        __sfree(deferred);
+        deferred = next;
+    }
+#endif
+}
+
+void __smalloc_drain(void) {
+    SMALLOC_LOCK();
+    for(struct SHEAP* heap = __heaps; heap; heap = heap->next) {
+        ENTER_HEAP(heap);
+        __drain((SIZE_T)-1);
+        LEAVE_HEAP();
+    }
+    SMALLOC_UNLOCK();
+}
+#endif
+
+// Public entry points: take the lock (SMALLOC_SAFE) around the internals
+#ifdef SMALLOC_DEBUG
+#define CANARY_BYTE     0xfd    // fills a chunk past the bytes asked for
+#define POISON_BYTE     0xdd    // fills freed memory
+
+static void (*__smalloc_fault)(const char* what, void* ptr) = NULL;
+
+void __smalloc_set_fault(void (*fault)(const char* what, void* ptr)) {
+    __smalloc_fault = fault;
+}
+
+// Report a problem -- returns 1 so problems can be counted
+static int __fault(const char* what, void* ptr) {
+    if(__smalloc_fault) __smalloc_fault(what, ptr);
+    return 1;
+}
+
+// Tag memory that is being handed out as live, and fill the space past n with canary bytes
+static void* __debug_live(void* ptr, SIZE_T n) {
+    if(!ptr) return NULL;
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    chunk->magic = CHUNK_LIVE;
+    chunk->request = n;
+    memset(ptr + n, CANARY_BYTE, CHUNK_SIZE(chunk) - CHUNK_HEADER_SZ - n);
+    return ptr;
+}
+
+static int __canary_intact(struct CHUNK* chunk) {
+    unsigned char* c = (void *)chunk + CHUNK_HEADER_SZ + chunk->request;
+    unsigned char* end = (void *)chunk + CHUNK_SIZE(chunk);
+    while(c < end) {
+        if(*c++ != CANARY_BYTE) return 0;
+    }
+    return 1;
+}
+
+// Check a pointer given to sfree or srealloc
+// returns 0 when it is not a live allocation and the heap must not be touched
+static int __debug_check(struct SHEAP* heap, void* ptr) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    const char* problem = NULL;
+    SMALLOC_LOCK();
+    ENTER_HEAP(heap);
+    void* frontier = __last_block ? (void *)__last_block + __last_block->size : HEAP_BOTTOM;
+    if((void *)chunk < HEAP_BOTTOM || ptr >= frontier) {
+        problem = "not an allocation";
+    } else if(chunk->magic == CHUNK_DEAD) {
+        problem = "double free";
+    } else if(chunk->magic != CHUNK_LIVE || !(CHUNK_FLAGS(chunk) & ALLOCD)) {
+        problem = "not an allocation";
+    } else {
+        struct BLOCK* block = __first_block;
+        while(block && block != CHUNK_BLOCK(chunk)) block = block->next;
+        if(!block || block->kind != BLOCK_CHUNKS ||
+            (void *)chunk < (void *)block + BLOCK_HEADER_SZ || (void *)chunk >= block->top) {
+            problem = "chunk is not in a block";
+        }
+    }
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    if(problem) return !__fault(problem, ptr);
+
+    if(!__canary_intact(chunk)) __fault("write past the end", ptr);
+    return 1;
+}
+
+// Tag memory that is being freed as dead, and poison it
+static void __debug_kill(void* ptr) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    chunk->magic = CHUNK_DEAD;
+    memset(ptr, POISON_BYTE, CHUNK_SIZE(chunk) - CHUNK_HEADER_SZ);
+}
+
+// Walk every block and chunk, checking the links, tags and boundary tags
+// Each problem is reported to the fault hook (with the lock held).
+int __smalloc_check(void) {
+    int problems = 0;
+    SIZE_T inFree = 0;
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    struct BLOCK* prev = NULL;
+    void* expected = HEAP_BOTTOM;
+    for(struct BLOCK* block = __first_block; block; prev = block, block = block->next) {
+        if((void *)block != expected || block->prev != prev ||
+            block->size < BLOCK_HEADER_SZ || (void *)block + block->size - 1 > HEAP_TOP) {
+            problems += __fault("bad block", block);
+            prev = __last_block; // the rest of the list can't be trusted
+            break;
+        }
+        expected = (void *)block + block->size;
+        if(block->kind != BLOCK_CHUNKS) continue;
+
+        void* end = (void *)block + block->size;
+        if(block->top < (void *)block + BLOCK_HEADER_SZ || block->top > end ||
+            block->remaining != (SIZE_T)(end - block->top)) {
+            problems += __fault("bad block top", block);
+            continue;
+        }
+        int prevFree = 0;
+        struct CHUNK* chunk = (void *)block + BLOCK_HEADER_SZ;
+        while((void *)chunk < block->top) {
+            if(CHUNK_BLOCK(chunk) != block || CHUNK_SIZE(chunk) < MIN_CHUNK_SZ || CHUNK_SIZE(chunk) % SMALLOC_ALIGN ||
+                (void *)chunk + CHUNK_SIZE(chunk) > block->top) {
+                problems += __fault("bad chunk", chunk);
+                break;
+            }
+            if(!(CHUNK_FLAGS(chunk) & PREVFREE) != !prevFree) problems += __fault("bad PREVFREE flag", chunk);
+            if(CHUNK_FLAGS(chunk) & ALLOCD) {
+                // a dead chunk that is still allocated is in a cache (or pending)
+                if(chunk->magic == CHUNK_LIVE) {
+                    if(!__canary_intact(chunk)) problems += __fault("write past the end", chunk);
+                } else if(chunk->magic != CHUNK_DEAD) {
+                    problems += __fault("bad magic", chunk);
+                }
+                prevFree = 0;
+            } else {
+                if(chunk->magic != CHUNK_DEAD) problems += __fault("bad magic", chunk);
+                if(prevFree) problems += __fault("free chunks not coalesced", chunk);
+                if(FOOTER(chunk) != CHUNK_SIZE(chunk)) problems += __fault("bad footer", chunk);
+                inFree += CHUNK_SIZE(chunk);
+                prevFree = 1;
+            }
+            chunk = (void *)chunk + CHUNK_SIZE(chunk);
+        }
+        if(prevFree) problems += __fault("free chunk below top", block);
+    }
+    if(prev != __last_block) problems += __fault("bad last block", __last_block);
+    if(inFree != __stats.inFree) problems += __fault("free chunks and bins disagree", NULL);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    return problems;
+}
+
+#define DEBUG_LIVE(ptr, n)  __debug_live(ptr, n)
+#else
+#define DEBUG_LIVE(ptr, n)  (ptr)
+#endif
+
+#ifdef SMALLOC_TRACE
+static struct STRACE __trace_ring[SMALLOC_TRACE_RING];
+static SIZE_T __trace_made = 0;         // records ever made
+static SIZE_T __trace_read = 0;         // records ever read or lost
+static SIZE_T __trace_lost = 0;         // records lost since the last read
+static unsigned long (*__trace_tick)(void) = NULL;
+static void (*__trace_sink)(const struct STRACE *record) = NULL;
+
+void __smalloc_set_trace(unsigned long (*tick)(void), void (*sink)(const struct STRACE *record)) {
+    __trace_tick = tick;
+    __trace_sink = sink;
+}
+
+static void __put_le(unsigned char *bytes, unsigned count, SIZE_T value) {
+    for(unsigned i = 0; i < count; i++) {
+        bytes[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+// Record an operation, overwriting the oldest unread record if the ring is full
+static void __trace(unsigned char op, void *ptr, SIZE_T size, void *old) {
+    SMALLOC_LOCK();
+    struct STRACE *record = &__trace_ring[__trace_made % SMALLOC_TRACE_RING];
+    record->op = op;
+    __put_le(record->size, sizeof(record->size), size < 0xffffff ? size : 0xffffff);
+    __put_le(record->tick, sizeof(record->tick), __trace_tick ? __trace_tick() : __trace_made);
+    __put_le(record->ptr, sizeof(record->ptr), (SIZE_T)ptr);
+    __put_le(record->old, sizeof(record->old), (SIZE_T)old);
+    if(++__trace_made - __trace_read > SMALLOC_TRACE_RING) {
+        __trace_read++;
+        __trace_lost++;
+    }
+    if(__trace_sink) __trace_sink(record);
+    SMALLOC_UNLOCK();
+}
+
+unsigned long __smalloc_trace_read(struct STRACE *out, unsigned long max, unsigned long *lost) {
+    SMALLOC_LOCK();
+    unsigned long count = 0;
+    while(count < max && __trace_read < __trace_made) {
+        out[count++] = __trace_ring[__trace_read++ % SMALLOC_TRACE_RING];
+    }
+    *lost = __trace_lost;
+    __trace_lost = 0;
+    SMALLOC_UNLOCK();
+    return count;
+}
+
+#define TRACE(op, ptr, size, old)   __trace(op, ptr, size, old)
+#else
+#define TRACE(op, ptr, size, old)
+#endif
+
+void* sheap_alloc(struct SHEAP* heap, SIZE_T n) {
+    SMALLOC_LOCK();
+    ENTER_HEAP(heap);
+    void* ptr = __smalloc(n);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    TRACE('a', ptr, n, NULL);
+    return DEBUG_LIVE(ptr, n);
+}
+
+void sheap_free(struct SHEAP* heap, void *ptr) {
+    if(!ptr) return;
+#ifdef SMALLOC_DEBUG
+    if(!__debug_check(heap, ptr)) return;
+    __debug_kill(ptr);
+#endif
+    TRACE('f', ptr, 0, NULL);
+#ifdef SMALLOC_SAFE
+    // caches only hold chunks of the default heap
+    if(heap == &__default_heap && __cache_push(ptr)) return;
+#endif
+#ifdef SMALLOC_DEFER
+    __defer(heap, ptr);
+#else
+    SMALLOC_LOCK();
+    ENTER_HEAP(heap);
+    __sfree(ptr);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+#endif
+}
+
+void* smalloc(SIZE_T n) {
+#ifdef SMALLOC_SAFE
+    void* cached = __cache_pop(n);
+    if(cached) {
+        TRACE('a', cached, n, NULL);
+        return DEBUG_LIVE(cached, n);
+    }
+#endif
+    return sheap_alloc(&__default_heap, n);
+}
+
+// smalloc next to near, in near's heap; without a (valid) near it is smalloc
+void* smalloc_near(void* near, SIZE_T n) {
+    struct SHEAP* heap = near ? __heap_of(near) : NULL;
+#ifdef SMALLOC_DEBUG
+    if(heap && !__debug_check(heap, near)) heap = NULL;
+#endif
+    if(!heap) return smalloc(n);
+    SMALLOC_LOCK();
+    ENTER_HEAP(heap);
+    void* ptr = __smalloc_near(near, n);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    TRACE('a', ptr, n, NULL);
+    return DEBUG_LIVE(ptr, n);
+}
+
+// smalloc from the blocks of a lifetime; an unknown lifetime is taken as SMALLOC_LONG
+void* smalloc_hint(SIZE_T n, unsigned lifetime) {
+    if(lifetime >= LIFETIMES) lifetime = SMALLOC_LONG;
+    if(lifetime == SMALLOC_LONG) return smalloc(n);
+    SMALLOC_LOCK();
+    ENTER_HEAP(&__default_heap);
+    __lifetime = lifetime;
+    void* ptr = __smalloc(n);
+    __lifetime = SMALLOC_LONG;
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    TRACE('a', ptr, n, NULL);
+    return DEBUG_LIVE(ptr, n);
+}
+
+// sfree and srealloc take memory from any heap
+void sfree(void *ptr) {
+    if(!ptr) return;
+    struct SHEAP* heap = __heap_of(ptr);
+    if(!heap) {
+#ifdef SMALLOC_DEBUG
+        __fault("not an allocation", ptr);
+#endif
+        return; // ruh-roh
+    }
+    sheap_free(heap, ptr);
+}
+
+// Allocate count objects of n bytes each into out[]
+// returns how many were allocated -- fewer than count only when memory runs out
+SIZE_T smalloc_n(SIZE_T n, SIZE_T count, void* out[]) {
+    SMALLOC_LOCK();
+    ENTER_HEAP(&__default_heap);
+    SIZE_T done = __smalloc_n(n, count, out);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    for(SIZE_T i = 0; i < done; i++) {
+        TRACE('a', out[i], n, NULL);
+        out[i] = DEBUG_LIVE(out[i], n);
+    }
+    return done;
+}
+
+// Free count pointers (NULLs are skipped), from any heap
+// ptrs[] is sorted by address so that runs of physically adjacent chunks --
+// like a batch from smalloc_n -- are merged and given back as one chunk.
+void sfree_n(void* ptrs[], SIZE_T count) {
+    for(SIZE_T i = 0; i < count; i++) {
+        if(!ptrs[i]) continue;
+#ifdef SMALLOC_DEBUG
+        struct SHEAP* heap = __heap_of(ptrs[i]);
+        if(!heap) __fault("not an allocation", ptrs[i]);
+        if(!heap || !__debug_check(heap, ptrs[i])) {
+            ptrs[i] = NULL;
+            continue;
+        }
+        __debug_kill(ptrs[i]);
+#endif
+        TRACE('f', ptrs[i], 0, NULL);
+    }
+
+    // insertion sort; batches usually arrive in (or close to) address order
+    for(SIZE_T i = 1; i < count; i++) {
+        void* ptr = ptrs[i];
+        SIZE_T j = i;
+        for(; j > 0 && ptrs[j - 1] > ptr; j--) ptrs[j] = ptrs[j - 1];
+        ptrs[j] = ptr;
+    }
+
+    SMALLOC_LOCK();
+    for(SIZE_T i = 0; i < count; ) {
+        struct SHEAP* heap = ptrs[i] ? __heap_of(ptrs[i]) : NULL;
+        struct CHUNK* first = ptrs[i] - CHUNK_HEADER_SZ;
+        if(!heap || !(CHUNK_FLAGS(first) & ALLOCD)) {
+            i++;
+            continue; // ruh-roh
+        }
+        // a chunk that ends where the next one starts is in the same block
+        SIZE_T size = CHUNK_SIZE(first);
+        SIZE_T chunks = 1;
+        for(i++; i < count; i++, chunks++) {
+            struct CHUNK* next = ptrs[i] - CHUNK_HEADER_SZ;
+            if((void *)next != (void *)first + size || !(CHUNK_FLAGS(next) & ALLOCD)) break;
+            CLEAR_FLAG(next, ALLOCD); // so a duplicate pointer is seen as freed
+            size += CHUNK_SIZE(next);
+        }
+        ENTER_HEAP(heap);
+        __sfree_run(first, size, chunks);
+        LEAVE_HEAP();
+    }
+    SMALLOC_UNLOCK();
+}
+
+void* srealloc(void *ptr, SIZE_T n) {
+    struct SHEAP* heap = ptr ? __heap_of(ptr) : &__default_heap;
+    if(!heap) {
+#ifdef SMALLOC_DEBUG
+        __fault("not an allocation", ptr);
+#endif
+        return NULL; // ruh-roh
+    }
+#ifdef SMALLOC_DEBUG
+    if(ptr && !__debug_check(heap, ptr)) return NULL;
+#endif
+    SMALLOC_LOCK();
+    ENTER_HEAP(heap);
+    void* moved = __srealloc(ptr, n);
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+    TRACE('r', moved, n, ptr);
+    return DEBUG_LIVE(moved, n);
+}
+
+void* saligned_alloc(SIZE_T align, SIZE_T n) {
+    SMALLOC_LOCK();
+    void* ptr = __saligned_alloc(align, n);
+    SMALLOC_UNLOCK();
+    TRACE('a', ptr, n, NULL);
+    return DEBUG_LIVE(ptr, n);
+}
+
+// Allocate zeroed memory for count objects of size bytes
+// returns NULL if count * size overflows
+void* scalloc(SIZE_T count, SIZE_T size) {
+    if(size && count > (SIZE_T)-1 / size) return NULL;
+    SIZE_T n = count * size;
+#ifdef SMALLOC_SAFE
+    void* cached = __cache_pop(n);
+    if(cached) {
+        memset(cached, 0, n);
+        TRACE('a', cached, n, NULL);
+        return DEBUG_LIVE(cached, n);
+    }
+#endif
+    SMALLOC_LOCK();
+    void* ptr = __scalloc(n);
+    SMALLOC_UNLOCK();
+    TRACE('a', ptr, n, NULL);
+    return DEBUG_LIVE(ptr, n);
+}
+
+// Allocate n bytes at a multiple of align (a power of two)
+// We over-allocate by enough to find an aligned spot that leaves room for a
+// free chunk in front of it, then give back the leading and trailing space.
+void* __saligned_alloc(SIZE_T align, SIZE_T n) {
+    if(!align || (align & (align - 1))) return NULL; // not a power of two
+    if(align <= SMALLOC_ALIGN) return __smalloc(n);
+
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize || align > (SIZE_T)(HEAP_TOP - HEAP_BOTTOM)) return NULL;
+
+    void* ptr = __smalloc(allocSize + align + MIN_CHUNK_SZ);
+    if(!ptr) return NULL;
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+
+    if((SIZE_T)ptr & (align - 1)) {
+        // the leading space must be big enough to be freed as a chunk of its own
+        void* aligned = (void *)ALIGN_UP(ptr + MIN_CHUNK_SZ, align);
+        struct CHUNK* lead = chunk;
+        chunk = aligned - CHUNK_HEADER_SZ;
+        SET_BLOCK(chunk, CHUNK_BLOCK(lead));
+        SET_SIZE(chunk, CHUNK_SIZE(lead) - ((void *)chunk - (void *)lead));
+        SET_FLAGS(chunk, ALLOCD);
+        SET_SIZE(lead, (void *)chunk - (void *)lead);
+        CLEAR_FLAG(lead, ALLOCD);
+        __free_chunk(lead);
+        ptr = aligned;
+    }
+    __trim_chunk(chunk, allocSize);
+    return ptr;
+}
+
+// Resize smalloc'd space to n bytes, in place if at all possible
+// - shrinking: split off the tail
+// - growing when the chunk is the last one in its block: bump the block's top
+// - growing when the next chunk is free and big enough: absorb it, then split
+// Otherwise, allocate, copy and free. On failure, ptr is left untouched.
+void* __srealloc(void *ptr, SIZE_T n) {
+    if(!ptr) return __smalloc(n);
+    if(!n) {
+        __sfree(ptr);
+        return NULL;
+    }
+
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD)) return NULL; // ruh-roh
+    SIZE_T allocSize = __chunk_size(n);
+    if(!allocSize) return NULL;
+
+    if(allocSize <= CHUNK_SIZE(chunk)) {
+        __trim_chunk(chunk, allocSize);
+        return ptr;
+    }
+
+    struct BLOCK* block = CHUNK_BLOCK(chunk);
+    struct CHUNK* next = (void *)chunk + CHUNK_SIZE(chunk);
+    SIZE_T needed = allocSize - CHUNK_SIZE(chunk);
+    if((void *)next == block->top) {
+        if(block->remaining >= needed) {
+            block->top += needed;
+            __set_remaining(block, block->remaining - needed);
+            SET_SIZE(chunk, allocSize);
+            __note_peak();
+            return ptr;
+        }
+    } else if(!(CHUNK_FLAGS(next) & ALLOCD) && CHUNK_SIZE(next) >= needed) {
+        __bin_unlink((struct FREED *)next);
+        SET_SIZE(chunk, CHUNK_SIZE(chunk) + CHUNK_SIZE(next));
+        // a free chunk is never the last one before top, so this is a chunk
+        next = (void *)chunk + CHUNK_SIZE(chunk);
+        CLEAR_FLAG(next, PREVFREE);
+        __trim_chunk(chunk, allocSize);
+        __note_peak();
+        return ptr;
+    }
+
+    // the memory keeps its lifetime
+    unsigned lifetime = __lifetime;
+    __lifetime = block->lifetime;
+    void* moved = __smalloc(n);
+    __lifetime = lifetime;
+    if(!moved) return NULL;
+    memcpy(moved, ptr, CHUNK_SIZE(chunk) - CHUNK_HEADER_SZ);
+    __sfree(ptr);
+    return moved;
 }
 
 // Free a given pointer to smalloc'd space
 // 1. Re-establish the struct CHUNK data
-// 2. Verify that we are allocated (TODO: add magic word for additional test?)
-// 3. Enqueue the chunk into the free-list
-// 4. Mark chunk as free (~ALLOCD)
-void sfree(void *ptr) {
-    struct CHUNK* chunk = ptr - sizeof(struct CHUNK); // reestablish the metadata
-    if(!(chunk->flags & ALLOCD)) return; // ruh-roh
-    // mark it as free, enqueue it into the free list of the block
-    struct BLOCK* block = chunk->block;
-    struct FREED* freed = (struct FREED *)chunk;
-    freed->prev = NULL;
-    freed->next = block->free;
-    if(!block->free) {
-        block->free = freed;
+// 2. Verify that we are allocated (sfree checks the magic word in SMALLOC_DEBUG builds)
+// 3. Mark chunk as free (~ALLOCD)
+// 4. Coalesce with free neighbours and enqueue the result into the bin for its size
+void __sfree(void *ptr) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ; // reestablish the metadata
+    if(!(CHUNK_FLAGS(chunk) & ALLOCD)) return; // ruh-roh
+    CLEAR_FLAG(chunk, ALLOCD); // mark it as freed
+    __stats.live--;
+    __free_chunk(chunk);
+}
+
+// Free a run of physically adjacent allocated chunks, starting at first and
+// size bytes long in all, as one chunk
+void __sfree_run(struct CHUNK* first, SIZE_T size, SIZE_T chunks) {
+    SET_SIZE(first, size);
+    CLEAR_FLAG(first, ALLOCD);
+    __stats.live -= chunks;
+    __free_chunk(first);
+}
+
+// Give a chunk (no longer ALLOCD) back to its block
+// The chunk is merged with the physically previous chunk (PREVFREE) and the
+// next chunk when they are free. Because neighbours are always merged when
+// freed, two free chunks are never adjacent and this is at most two merges.
+// If the result ends at block->top it is given back to the block instead
+// of being binned, so a free chunk never sits directly below top.
+void __free_chunk(struct CHUNK* chunk) {
+    struct BLOCK* block = CHUNK_BLOCK(chunk);
+    SIZE_T size = CHUNK_SIZE(chunk);
+
+    if(CHUNK_FLAGS(chunk) & PREVFREE) {
+        SIZE_T prevSize = *(SIZE_T *)((void *)chunk - sizeof(SIZE_T));
+        chunk = (void *)chunk - prevSize;
+        __bin_unlink((struct FREED *)chunk);
+        size += prevSize;
+    }
+
+    struct CHUNK* next = (void *)chunk + size;
+    if((void *)next == block->top) {
+        block->top = chunk;
+        __set_remaining(block, block->remaining + size);
+        if(block == __last_block) __release_trailing_blocks();
+        return;
+    }
+    if(!(CHUNK_FLAGS(next) & ALLOCD)) {
+        __bin_unlink((struct FREED *)next);
+        size += CHUNK_SIZE(next);
+        next = (void *)chunk + size;
+    }
+
+    SET_SIZE(chunk, size);
+    SET_FLAGS(chunk, 0); // the previous chunk is allocated - otherwise we merged it
+#ifdef SMALLOC_DEBUG
+    chunk->magic = CHUNK_DEAD;
+#endif
+    FOOTER(chunk) = size;
+    SET_FLAG(next, PREVFREE);
+    __bin_insert((struct FREED *)chunk);
+}
+
+// Shrink an allocated chunk down to size bytes (inclusive of the header)
+// The tail is split off and freed when it is big enough to be a chunk of its own.
+void __trim_chunk(struct CHUNK* chunk, SIZE_T size) {
+    if(CHUNK_SIZE(chunk) - size < MIN_CHUNK_SZ) return;
+    struct CHUNK* rest = (void *)chunk + size;
+    SET_BLOCK(rest, CHUNK_BLOCK(chunk));
+    SET_SIZE(rest, CHUNK_SIZE(chunk) - size);
+    SET_FLAGS(rest, 0); // chunk is allocated, so rest has no PREVFREE
+    SET_SIZE(chunk, size);
+    __free_chunk(rest);
+}
+
+// Slide an allocation down over the free chunk in front of it (compaction)
+// The free space ends up after it, where it merges with whatever is free next.
+// returns the new address, or NULL when the chunk in front is not free
+void* __slide_chunk(void* ptr) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    if(!(CHUNK_FLAGS(chunk) & PREVFREE)) return NULL;
+    SIZE_T size = CHUNK_SIZE(chunk);
+    SIZE_T gap = *(SIZE_T *)((void *)chunk - sizeof(SIZE_T));
+
+    struct CHUNK* moved = (void *)chunk - gap;
+    __bin_unlink((struct FREED *)moved);
+    memmove(moved, chunk, size);
+    SET_FLAGS(moved, ALLOCD); // the chunk in front of the gap is allocated
+
+    struct CHUNK* rest = (void *)moved + size;
+    SET_BLOCK(rest, CHUNK_BLOCK(moved));
+    SET_SIZE(rest, gap);
+    SET_FLAGS(rest, 0);
+    __free_chunk(rest);
+    return (void *)moved + CHUNK_HEADER_SZ;
+}
+
+// Move an allocation into space the heap already has below limit (compaction)
+// No block is made for it.
+// returns the new address, or NULL when there is no such space
+void* __lower_chunk(void* ptr, void* limit) {
+    struct CHUNK* chunk = ptr - CHUNK_HEADER_SZ;
+    SIZE_T size = CHUNK_SIZE(chunk);
+    struct CHUNK* moved;
+
+    // the memory keeps its lifetime: look in the lane of the chunk's block
+    unsigned lifetime = __lifetime;
+    __lifetime = CHUNK_BLOCK(chunk)->lifetime;
+    struct FREED* freed = __use_freed_chunk(size);
+    if(freed && (void *)freed < limit) {
+        moved = (struct CHUNK *)freed;
+        SET_FLAGS(moved, ALLOCD);
+        struct CHUNK* next = (void *)moved + CHUNK_SIZE(moved);
+        CLEAR_FLAG(next, PREVFREE);
+        __trim_chunk(moved, size);
     } else {
-        block->free->prev = freed;
-        block->free = freed; 
-    }
-    freed->header.flags &= ~ALLOCD; // mark it as freed
-}
-
-// Find a freed chunk that meets the given size requirements
-struct FREED* __use_freed_chunk(SIZE_T minSize, SIZE_T maxSize) {
-    struct BLOCK* block = __first_block;
-    while(block) {
-        struct FREED* freed = block->free;
-        while(freed) {
-            if(freed->header.size >= minSize && freed->header.size <= maxSize) {
-                // found one - dequeue it and return it
-                if(freed == block->free) block->free = freed->next;
-                if(freed->next) freed->next->prev = freed->prev;
-                if(freed->prev) freed->prev->next = freed->next;
-                return freed;
-            }   
-            freed = freed->next;
+        if(freed) __bin_insert(freed); // not below limit, put it back
+        struct BLOCK* block = __block_with_free_space(size);
+        if(!block || (void *)block >= limit) {
+            __lifetime = lifetime;
+            return NULL;
+        }
+        moved = block->top;
+        block->top += size;
+        __set_remaining(block, block->remaining - size);
+        SET_BLOCK(moved, block);
+        SET_SIZE(moved, size);
+        SET_FLAGS(moved, ALLOCD);
+    }
+    __lifetime = lifetime;
+    memcpy((void *)moved + CHUNK_HEADER_SZ, ptr, size - CHUNK_HEADER_SZ);
+#ifdef SMALLOC_DEBUG
+    // a freed chunk may have been a little too big to split
+    moved->magic = chunk->magic;
+    moved->request = chunk->request;
+    memset((void *)moved + size, CANARY_BYTE, CHUNK_SIZE(moved) - size);
+#endif
+
+    // the old chunk is freed without counting it; the allocation lives on
+    CLEAR_FLAG(chunk, ALLOCD);
+    __free_chunk(chunk);
+    return (void *)moved + CHUNK_HEADER_SZ;
+}
+
+// Index of the lowest set bit in a (non-zero) bin map
+static unsigned __lowest_bit(unsigned long map) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzl(map);
+#else
+    unsigned i = 0;
+    while(!(map & 1)) {
+        map >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// Index of the highest set bit in a (non-zero) map or size
+static unsigned __highest_bit(unsigned long map) {
+#if defined(__GNUC__)
+    return (unsigned)(sizeof(unsigned long) * 8 - 1 - __builtin_clzl(map));
+#else
+    unsigned i = 0;
+    while(map >>= 1) i++;
+    return i;
+#endif
+}
+
+// The tree bin for a chunk size of at least SMALL_LIMIT
+static unsigned __tree_index(SIZE_T size) {
+    unsigned i = __highest_bit(size) - __highest_bit(SMALL_LIMIT);
+    return i < TREE_BINS ? i : TREE_BINS - 1;
+}
+
+// The bit of a size that picks the child at the root of a tree bin. Sizes
+// in a bin agree on every bit above it; the last bin is open-ended.
+static unsigned __tree_shift(unsigned index) {
+    if(index == TREE_BINS - 1) return sizeof(SIZE_T) * 8 - 1;
+    return __highest_bit(SMALL_LIMIT) + index - 1;
+}
+
+// Put a freed chunk into its tree bin
+// Walk down, branching on the bits of the size, to the node of the same size
+// (and join its list) or to an empty child slot (and become a leaf there).
+void __tree_insert(struct TFREED* node) {
+    SIZE_T size = CHUNK_SIZE(&node->freed.header);
+    unsigned index = __tree_index(size);
+    node->child[0] = NULL;
+    node->child[1] = NULL;
+    node->freed.next = NULL;
+    node->freed.prev = NULL;
+    node->index = index;
+
+    struct SLANE* lane = &CHUNK_LANE(node);
+    struct TFREED* t = lane->treeBins[index];
+    if(!t) {
+        lane->treeBins[index] = node;
+        lane->treeMap |= 1UL << index;
+        node->parent = NULL;
+        return;
+    }
+    for(unsigned bit = __tree_shift(index); ; bit--) {
+        if(CHUNK_SIZE(&t->freed.header) == size) {
+            // same size: join the list hanging off the tree node
+            struct FREED* first = &t->freed;
+            node->freed.next = first->next;
+            node->freed.prev = first;
+            if(first->next) first->next->prev = &node->freed;
+            first->next = &node->freed;
+            node->parent = NULL;
+            return;
+        }
+        struct TFREED** slot = &t->child[(size >> bit) & 1];
+        if(!*slot) {
+            *slot = node;
+            node->parent = t;
+            return;
+        }
+        t = *slot;
+    }
+}
+
+// Point whatever referenced node in the tree (its parent or the bin) at other
+static void __tree_replace(struct SLANE* lane, struct TFREED* node, struct TFREED* other) {
+    if(!node->parent) lane->treeBins[node->index] = other;
+    else if(node->parent->child[0] == node) node->parent->child[0] = other;
+    else node->parent->child[1] = other;
+    if(other) other->parent = node->parent;
+}
+
+// Take a freed chunk out of its tree bin
+void __tree_unlink(struct TFREED* node) {
+    if(node->freed.prev) {
+        // in a same-size list, not the tree itself
+        node->freed.prev->next = node->freed.next;
+        if(node->freed.next) node->freed.next->prev = node->freed.prev;
+        return;
+    }
+
+    struct SLANE* lane = &CHUNK_LANE(node);
+    struct TFREED* other = (struct TFREED *)node->freed.next;
+    if(other) {
+        // the next chunk of the same size takes the node's place
+        other->freed.prev = NULL;
+    } else if(node->child[0] || node->child[1]) {
+        // any leaf below the node shares its prefix, so it can take the node's place
+        other = node->child[1] ? node->child[1] : node->child[0];
+        while(other->child[0] || other->child[1]) {
+            other = other->child[1] ? other->child[1] : other->child[0];
+        }
+        __tree_replace(lane, other, NULL);
+    }
+    __tree_replace(lane, node, other);
+    if(other) {
+        other->index = node->index;
+        other->child[0] = node->child[0];
+        other->child[1] = node->child[1];
+        if(other->child[0]) other->child[0]->parent = other;
+        if(other->child[1]) other->child[1]->parent = other;
+    }
+    if(!lane->treeBins[node->index]) lane->treeMap &= ~(1UL << node->index);
+}
+
+// Find the smallest freed chunk of at least minSize bytes in the current lane's tree bins
+// Follow minSize's bits down its own bin, remembering the best fit and the
+// last right subtree skipped over (everything in it is larger than minSize).
+// If nothing fits on the path, the smallest chunk of that subtree, or of the
+// next non-empty bin, is the best fit: walk it along the leftmost path.
+struct TFREED* __tree_best_fit(SIZE_T minSize) {
+    struct TFREED* best = NULL;
+    SIZE_T bestRest = -minSize; // anything smaller than minSize wraps past this
+    struct TFREED* t = NULL;
+
+    unsigned index = minSize < SMALL_LIMIT ? 0 : __tree_index(minSize);
+    if(minSize >= SMALL_LIMIT && __lane.treeBins[index]) {
+        struct TFREED* right = NULL;
+        t = __lane.treeBins[index];
+        for(unsigned bit = __tree_shift(index); ; bit--) {
+            SIZE_T rest = CHUNK_SIZE(&t->freed.header) - minSize;
+            if(rest < bestRest) {
+                best = t;
+                bestRest = rest;
+                if(!rest) return best;
+            }
+            struct TFREED* r = t->child[1];
+            t = t->child[(minSize >> bit) & 1];
+            if(r && r != t) right = r;
+            if(!t) {
+                t = right;
+                break;
+            }
+        }
+        index++;
+    }
+    if(!t && !best && index < TREE_BINS) {
+        unsigned long candidates = __lane.treeMap & (~0UL << index);
+        if(candidates) t = __lane.treeBins[__lowest_bit(candidates)];
+    }
+    while(t) {
+        SIZE_T rest = CHUNK_SIZE(&t->freed.header) - minSize;
+        if(rest < bestRest) {
+            best = t;
+            bestRest = rest;
+        }
+        t = t->child[0] ? t->child[0] : t->child[1];
+    }
+    return best;
+}
+
+// Push a freed chunk onto the head of its bin, in its block's lane
+void __bin_insert(struct FREED* freed) {
+    SIZE_T size = CHUNK_SIZE(&freed->header);
+    __stats.inFree += size;
+    if(size >= SMALL_LIMIT) {
+        __tree_insert((struct TFREED *)freed);
+        return;
+    }
+    struct SLANE* lane = &CHUNK_LANE(freed);
+    unsigned index = size / BIN_GRANULE;
+    freed->prev = NULL;
+    freed->next = lane->smallBins[index];
+    if(freed->next) freed->next->prev = freed;
+    lane->smallBins[index] = freed;
+    lane->smallMap |= 1UL << index;
+}
+
+// Remove a freed chunk from its bin
+void __bin_unlink(struct FREED* freed) {
+    SIZE_T size = CHUNK_SIZE(&freed->header);
+    __stats.inFree -= size;
+    if(size >= SMALL_LIMIT) {
+        __tree_unlink((struct TFREED *)freed);
+        return;
+    }
+    struct SLANE* lane = &CHUNK_LANE(freed);
+    unsigned index = size / BIN_GRANULE;
+    if(freed == lane->smallBins[index]) lane->smallBins[index] = freed->next;
+    if(freed->next) freed->next->prev = freed->prev;
+    if(freed->prev) freed->prev->next = freed->next;
+    if(!lane->smallBins[index]) lane->smallMap &= ~(1UL << index);
+}
+
+// Find the best-fitting freed chunk of at least minSize bytes in the current lane
+// and take it out of its bin. Small bins are exact, so the lowest non-empty small bin at or above minSize
+// is the best fit. Past those, the tree bins are searched for the best fit.
+struct FREED* __use_freed_chunk(SIZE_T minSize) {
+    struct FREED* freed = NULL;
+    if(minSize < SMALL_LIMIT) {
+        unsigned long candidates = __lane.smallMap & (~0UL << (minSize / BIN_GRANULE));
+        if(candidates) freed = __lane.smallBins[__lowest_bit(candidates)];
+    }
+    if(!freed) freed = (struct FREED *)__tree_best_fit(minSize);
+    if(freed) __bin_unlink(freed);
+    return freed;
+}
+
+// Find an empty block of another lifetime with room for size, and make it the current lifetime's
+// Blocks that emptied out while not at the end of the heap are recycled this way
+// when the heap can't grow.
+struct BLOCK* __adopt_empty_block(SIZE_T size) {
+#ifdef SMALLOC_RT
+    unsigned budget = RT_ADOPT;
+#else
+    unsigned budget = (unsigned)-1;
+#endif
+    for(unsigned lifetime = 0; lifetime < LIFETIMES; lifetime++) {
+        if(lifetime == __lifetime) continue;
+        struct SLANE* lane = &__heap->lanes[lifetime];
+        unsigned long candidates = lane->roomMap & (~0UL << __highest_bit(size));
+        while(candidates) {
+            struct BLOCK* block = lane->rooms[__lowest_bit(candidates)];
+            for(unsigned probes = 0; block && probes < ROOM_PROBES; probes++) {
+                if(!budget--) return NULL;
+                if(block->top == (void *)block + BLOCK_HEADER_SZ && block->remaining >= size) {
+                    __room_unlink(block);
+                    block->lifetime = __lifetime;
+                    __room_insert(block);
+                    return block;
+                }
+                block = block->roomNext;
+            }
+            candidates &= candidates - 1;
         }
-        block = block->next;
     }
     return NULL;
 }
 
-// Find a block with enough free space for the requested size
+// Find a block of the current lifetime with enough free space for the requested size
+// Any block in a higher room fits, so take the head of the lowest one. Failing
+// that, the room size falls into holds blocks with less room too; try a few.
 struct BLOCK* __block_with_free_space(SIZE_T size) {
-    struct BLOCK* block = __first_block;
-    while(block) {
+    unsigned index = __highest_bit(size);
+    unsigned long candidates = index + 1 < ROOMS ? __lane.roomMap & (~0UL << (index + 1)) : 0;
+    if(candidates) return __lane.rooms[__lowest_bit(candidates)];
+
+    struct BLOCK* block = __lane.rooms[index];
+    for(unsigned probes = 0; block && probes < ROOM_PROBES; probes++) {
         if(block->remaining >= size) return block;
-        block = block->next;
+        block = block->roomNext;
     }
     return NULL;
 }
 
-// Create a new block that minimally satisfies the requested size + overhead
-// Use PAGESIZE as a minimum size to ensure we are creating reasonably-sized blocks
-struct BLOCK* __new_block(SIZE_T requestedSize) {
-    // pick an appropriate block size - this is the actual allocation size of the BLOCK
-    // which needs to take into account the minimum block size (PAGESIZE), the requested
-    // allocation size, and the size of the block header
-    SIZE_T size = requestedSize + BLOCK_HEADER_SZ;
-    if(size < PAGESIZE) size = PAGESIZE;
+// Index a CHUNK block by its remaining space, if it has room for a chunk
+void __room_insert(struct BLOCK* block) {
+    if(block->remaining < MIN_CHUNK_SZ) return;
+    struct SLANE* lane = &BLOCK_LANE(block);
+    unsigned index = __highest_bit(block->remaining);
+    block->roomPrev = NULL;
+    block->roomNext = lane->rooms[index];
+    if(lane->rooms[index]) lane->rooms[index]->roomPrev = block;
+    lane->rooms[index] = block;
+    lane->roomMap |= 1UL << index;
+}
 
-    void *start = __last_block == NULL ? HEAP_BOTTOM : (void*)__last_block + __last_block->size + 1;
-    if(start + size > HEAP_TOP) return NULL; // hit the memory limit
+// Remove a CHUNK block from the index, if __room_insert put it there
+void __room_unlink(struct BLOCK* block) {
+    if(block->remaining < MIN_CHUNK_SZ) return;
+    struct SLANE* lane = &BLOCK_LANE(block);
+    unsigned index = __highest_bit(block->remaining);
+    if(block == lane->rooms[index]) lane->rooms[index] = block->roomNext;
+    if(block->roomNext) block->roomNext->roomPrev = block->roomPrev;
+    if(block->roomPrev) block->roomPrev->roomNext = block->roomNext;
+    if(!lane->rooms[index]) lane->roomMap &= ~(1UL << index);
+}
 
-    // allocate it
+// Change the remaining space of a CHUNK block, keeping the index and statistics current
+void __set_remaining(struct BLOCK* block, SIZE_T remaining) {
+    __stats.untouched += remaining;
+    __stats.untouched -= block->remaining;
+    __room_unlink(block);
+    block->remaining = remaining;
+    __room_insert(block);
+    // top has been this high, so everything under it may have been written
+    if(block->top > block->zeroed) block->zeroed = block->top;
+}
+
+#ifdef SMALLOC_COMPACT
+// Point the pagemap spans that start from start up to end at block
+static void __map_block(struct BLOCK* block, void* start, void* end) {
+    SIZE_T span = ALIGN_UP(start - HEAP_BOTTOM, 1UL << __page_shift) >> __page_shift;
+    for(; ((span << __page_shift)) < (SIZE_T)(end - HEAP_BOTTOM); span++) {
+        __pagemap[span] = block;
+    }
+}
+#endif
+
+// Make a CHUNK block of size bytes at start, the end of the heap
+static struct BLOCK* __place_block(void* start, SIZE_T size) {
     struct BLOCK* block = (struct BLOCK*)start;
 
     // book-keeping to make insertions and CHUNK allocations easy
-    block->free = NULL;
     block->prev = __last_block;
     block->next = NULL;
     block->size = size;
     block->remaining = block->size - BLOCK_HEADER_SZ;
     block->top = (void *)block + BLOCK_HEADER_SZ;
+    block->kind = BLOCK_CHUNKS;
+    block->lifetime = __lifetime;
+    // the memory past the heap's zeroed mark has never been used
+    block->zeroed = __zeroed > block->top ? __zeroed : block->top;
+    if(block->zeroed > start + size) block->zeroed = start + size;
+    if(__zeroed < start + size) __zeroed = start + size;
+    __stats.blocks++;
+    __stats.heap += size;
+    __stats.untouched += block->remaining;
+    __room_insert(block);
+#ifdef SMALLOC_COMPACT
+    // the block holds the start of every span from the first one at or after start
+    __map_block(block, start, start + size);
+#endif
     if(__first_block == NULL) {
         __first_block = block;
         __last_block = block;
@@ -244,43 +1757,291 @@ struct BLOCK* __new_block(SIZE_T requestedSize) {
     return block;
 }
 
+#ifdef SMALLOC_BANK
+typedef char __smalloc_bank_needs_align[SMALLOC_BANK % SMALLOC_ALIGN == 0 ? 1 : -1];
+
+// Where a block of size bytes goes when the heap ends at start
+// A block that fits in a bank but would have its chunks straddle a bank
+// boundary is moved up so that its chunks start at the boundary; the gap is
+// filled by __fill_gap. A bigger block goes at start.
+static void* __bank_place(void* start, SIZE_T size) {
+    SIZE_T boundary = ((SIZE_T)start + BLOCK_HEADER_SZ) / SMALLOC_BANK * SMALLOC_BANK + SMALLOC_BANK;
+    if(size - BLOCK_HEADER_SZ > SMALLOC_BANK || (SIZE_T)start + size <= boundary) return start;
+    void* placed = (void *)boundary - BLOCK_HEADER_SZ;
+    // with no CHUNK block to grow, the gap must hold a block of its own, and no
+    // block may be shorter than a page (SMALLOC_COMPACT's pagemap relies on it)
+    int growable = __last_block && __last_block->kind == BLOCK_CHUNKS;
+    if(!growable && (SIZE_T)(placed - start) < PAGESIZE) return start;
+    return placed;
+}
+
+// Fill the gap from start to end left in front of a block that __bank_place
+// moved up: the last block grows over it, or it becomes a block (of a page or more) itself
+static void __fill_gap(void* start, void* end) {
+    struct BLOCK* block = __last_block;
+    if(!block || block->kind != BLOCK_CHUNKS) {
+        __place_block(start, end - start);
+        return;
+    }
+    block->size += end - start;
+    __stats.heap += end - start;
+    if(__zeroed > start) block->zeroed = __zeroed < end ? __zeroed : end;
+    if(__zeroed < end) __zeroed = end;
+    __set_remaining(block, block->remaining + (end - start));
+#ifdef SMALLOC_COMPACT
+    __map_block(block, start, end);
+#endif
+}
+#endif
+
+// Create a new block that minimally satisfies the requested size + overhead
+// Use PAGESIZE as a minimum size to ensure we are creating reasonably-sized blocks
+struct BLOCK* __new_block(SIZE_T requestedSize) {
+    // pick an appropriate block size - this is the actual allocation size of the BLOCK
+    // which needs to take into account the minimum block size (PAGESIZE), the requested
+    // allocation size, and the size of the block header
+    SIZE_T size = requestedSize + BLOCK_HEADER_SZ;
+    if(size < PAGESIZE) size = PAGESIZE;
+    size = ALIGN_UP(size, SMALLOC_ALIGN);
+
+    // blocks are contiguous, so alignment of every block follows from HEAP_BOTTOM's
+    void *start = __last_block == NULL ? HEAP_BOTTOM : (void*)__last_block + __last_block->size;
+#ifdef SMALLOC_BANK
+    void *placed = __bank_place(start, size);
+#else
+    void *placed = start;
+#endif
+    if(placed + size - 1 > HEAP_TOP) return NULL; // hit the memory limit
+    if(!__commit_to(placed + size)) return NULL; // the page source has no more
+#ifdef SMALLOC_BANK
+    if(placed != start) __fill_gap(start, placed);
+#endif
+
+    // allocate it
+    return __place_block(placed, size);
+}
+
+#ifdef SMALLOC_COMPACT
+// Find the block of heap that holds a chunk (or any address in a block)
+static struct BLOCK* __heap_block_of(struct SHEAP* heap, void* ptr) {
+    struct BLOCK* block = heap->pagemap[(SIZE_T)(ptr - heap->bottom) >> heap->pageShift];
+    if(ptr >= (void *)block + block->size) block = block->next;
+    return block;
+}
+
+// a chunk of another heap than the current one (e.g. walked by a diagnostic)
+// is looked up in its own heap's pagemap
+struct BLOCK* __block_of(void* ptr) {
+    struct SHEAP* heap = ptr >= __heap->bottom && ptr <= __heap->top ? __heap : __heap_of(ptr);
+    return __heap_block_of(heap, ptr);
+}
+#endif
+
+// Create a new block for another allocator (spool, sarena) to manage
+// The block's space no longer counts as untouched; it is all in use by its owner.
+struct BLOCK* __claim_block(SIZE_T requestedSize, unsigned kind) {
+    struct BLOCK* block = __new_block(requestedSize);
+    if(!block) return NULL;
+    __room_unlink(block);
+    block->kind = kind;
+    __stats.untouched -= block->remaining;
+    __stats.inOthers += block->size;
+    __other_blocks++;
+    return block;
+}
+
+// Hand a claimed block back to smalloc as an empty CHUNK block
+void __release_block(struct BLOCK* block) {
+    block->kind = BLOCK_CHUNKS;
+    block->top = (void *)block + BLOCK_HEADER_SZ;
+    block->zeroed = (void *)block + block->size; // the pool or arena used all of it
+    block->remaining = block->size - BLOCK_HEADER_SZ;
+    __stats.untouched += block->remaining;
+    __stats.inOthers -= block->size;
+    __other_blocks--;
+    __room_insert(block);
+    if(block == __last_block) __release_trailing_blocks();
+}
+
+// Give empty CHUNK blocks at the end of the list back to the unallocated heap
+// An empty block's top is back at the start of its data; nothing else needs checking.
+void __release_trailing_blocks(void) {
+    struct BLOCK* block = __last_block;
+#ifdef SMALLOC_RT
+    // a real-time build leaves the rest of a run of empty blocks for allocations to use
+    for(unsigned released = 0; released < RT_RELEASE && block && block->kind == BLOCK_CHUNKS &&
+        block->top == (void *)block + BLOCK_HEADER_SZ; released++) {
+#else
+    while(block && block->kind == BLOCK_CHUNKS && block->top == (void *)block + BLOCK_HEADER_SZ) {
+#endif
+        __room_unlink(block);
+        __stats.blocks--;
+        __stats.heap -= block->size;
+        __stats.untouched -= block->remaining;
+        if(__zeroed == (void *)block + block->size) __zeroed = block->zeroed;
+        __last_block = block->prev;
+        if(__last_block) __last_block->next = NULL;
+        else __first_block = NULL;
+        block = __last_block;
+    }
+
+    // give the pages past the frontier back to the page source, but for one
+    // so that a heap breathing across a page boundary isn't committing every time
+    if(__release) {
+        void* frontier = __last_block ? (void *)__last_block + __last_block->size : HEAP_BOTTOM;
+        void* keep = __page_end(frontier) + PAGESIZE;
+        if(keep < __committed) {
+            __release(keep, __committed - keep);
+            __committed = keep;
+        }
+    }
+}
+
+// The end of the page (of PAGESIZE, from HEAP_BOTTOM) that end is in
+static void* __page_end(void* end) {
+    return HEAP_BOTTOM + (end - HEAP_BOTTOM + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+}
+
+// Make the heap's memory usable up to end, with the page source if it has one
+// returns 0 when the page source can't
+static int __commit_to(void* end) {
+    if(!__commit || end <= __committed) return 1;
+    end = __page_end(end);
+    if(end > HEAP_TOP) end = HEAP_TOP + 1;
+    if(!__commit(__committed, end - __committed)) return 0;
+    __committed = end;
+    return 1;
+}
+
+void __smalloc_stats(struct SMALLOC_STATS *stats) {
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    *stats = __stats;
+    stats->inUse = STATS_IN_USE();
+#ifdef SMALLOC_SAFE
+    // caches only hold chunks of the default heap
+    for(struct SCACHE* cache = __caches; cache && __heap == &__default_heap; cache = cache->next) {
+        stats->allocations += cache->allocations;
+    }
+#endif
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+}
+
+// The report size class of a chunk size
+static unsigned __report_class(SIZE_T size) {
+    unsigned i = __highest_bit(size);
+    return i < SMALLOC_REPORT_CLASSES ? i : SMALLOC_REPORT_CLASSES - 1;
+}
+
+void __smalloc_report(struct SMALLOC_REPORT *report) {
+    memset(report, 0, sizeof(struct SMALLOC_REPORT));
+    SIZE_T allFree = 0;
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    for(struct BLOCK* block = __first_block; block; block = block->next) {
+        struct SMALLOC_BLOCK_REPORT summary = { block, block->size, 0, 0, 0, block->lifetime };
+        if(block->kind != BLOCK_CHUNKS) {
+            summary.inUse = block->size - BLOCK_HEADER_SZ;
+        } else {
+            for(struct CHUNK* chunk = (void *)block + BLOCK_HEADER_SZ; (void *)chunk < block->top;
+                chunk = (void *)chunk + CHUNK_SIZE(chunk)) {
+                SIZE_T size = CHUNK_SIZE(chunk);
+                unsigned c = __report_class(size);
+                if(CHUNK_FLAGS(chunk) & ALLOCD) {
+                    report->liveChunks[c]++;
+                    report->liveBytes[c] += size;
+                    summary.inUse += size;
+                } else {
+                    report->freeChunks[c]++;
+                    report->freeBytes[c] += size;
+                    summary.inFree += size;
+                    if(size > report->largestFree) report->largestFree = size;
+                }
+            }
+            summary.untouched = block->remaining;
+            if(block->remaining > report->largestTop) report->largestTop = block->remaining;
+        }
+        allFree += summary.inFree + summary.untouched;
+        if(report->blocks < SMALLOC_REPORT_BLOCKS) report->block[report->blocks] = summary;
+        report->blocks++;
+    }
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
+
+    SIZE_T largest = report->largestFree > report->largestTop ? report->largestFree : report->largestTop;
+    while(allFree > (SIZE_T)-1 / 1000) {
+        // keep largest * 1000 from overflowing on 32-bit longs
+        allFree >>= 1;
+        largest >>= 1;
+    }
+    if(allFree) report->fragmentation = (unsigned)(1000 - largest * 1000 / allFree);
+}
+
 // Returns the total space taken by smalloc structures - utilized or not
 // blocks will hold the count of blocks allocated
 SIZE_T __smalloc_used(unsigned short *numBlocks, unsigned long *inBlocks) {
-    SIZE_T size = 0;
-    struct BLOCK* block = __first_block;
-    *numBlocks = 0;
-    *inBlocks = 0;
-    while(block) {
-        (*numBlocks)++;
-        *inBlocks += block->size - block->remaining;
-        size += block->size;
-        block = block->next;
-    }
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    *numBlocks = __stats.blocks;
+    *inBlocks = __stats.heap - __stats.untouched;
+    SIZE_T size = __stats.heap;
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
     return size;
 }
 
 SIZE_T __smalloc_avail(SIZE_T *inBlocks, SIZE_T *inFree) {
-    SIZE_T unallocdHeap = __last_block ? 
-        (void*)__last_block - HEAP_BOTTOM : 
-        HEAP_TOP - HEAP_BOTTOM;
-    
-    *inBlocks = 0;
-    *inFree = 0;
-
-    struct BLOCK* block = __first_block;
-    while(block) {
-        *inBlocks += block->remaining;
-        struct FREED* freed = block->free;
-        while(freed) {
-            *inFree += freed->header.size;
-            freed = freed->next;
-        }
-        block = block->next;
-    }
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    // blocks grow upward, so the unallocated heap is everything above the last one
+    void *frontier = __last_block ? (void*)__last_block + __last_block->size : HEAP_BOTTOM;
+    SIZE_T unallocdHeap = HEAP_TOP - frontier + 1;
+
+    *inBlocks = __stats.untouched;
+    *inFree = __stats.inFree;
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
     return unallocdHeap;
 }
 
+void __smalloc_diagnose(struct SHEAP* heap) {
+    SMALLOC_LOCK();
+    __diagnosed = heap ? heap : &__default_heap;
+    SMALLOC_UNLOCK();
+}
+
 void *__smalloc_first_block(void) {
-    return (void *)__first_block;
+    return (void *)__diagnosed->first;
+}
+
+struct BLOCK* __heap_first_block(void) {
+    return __first_block;
+}
+
+void __smalloc_bounds(void **bottom, void **top) {
+    *bottom = __diagnosed->bottom;
+    *top = __diagnosed->top;
+}
+
+// Walk a tree bin: each node, the list of its size, then its children
+static void __visit_tree(struct TFREED* t, void (*visit)(void*, unsigned), unsigned lifetime) {
+    for(; t; t = t->child[1]) {
+        for(struct FREED* freed = &t->freed; freed; freed = freed->next) visit(freed, lifetime);
+        __visit_tree(t->child[0], visit, lifetime);
+    }
+}
+
+void __smalloc_visit_bins(void (*visit)(void *chunk, unsigned lifetime)) {
+    SMALLOC_LOCK();
+    ENTER_HEAP(__diagnosed);
+    for(unsigned l = 0; l < LIFETIMES; l++) {
+        struct SLANE* lane = &__heap->lanes[l];
+        for(unsigned i = 0; i < SMALL_BINS; i++) {
+            for(struct FREED* freed = lane->smallBins[i]; freed; freed = freed->next) visit(freed, l);
+        }
+        for(unsigned i = 0; i < TREE_BINS; i++) __visit_tree(lane->treeBins[i], visit, l);
+    }
+    LEAVE_HEAP();
+    SMALLOC_UNLOCK();
 }
@@ -20,10 +20,213 @@ IN THE SOFTWARE.
 #ifndef __SMALLOC_H
 #define __SMALLOC_H
 
+// Every pointer returned by smalloc is aligned to SMALLOC_ALIGN, a power of two.
+// The default is the natural alignment of a long; build with e.g. -DSMALLOC_ALIGN=16 for more.
+#ifndef SMALLOC_ALIGN
+#define SMALLOC_ALIGN (sizeof(unsigned long))
+#endif
+
+// Build with e.g. -DSMALLOC_BANK=0x10000 to keep the chunks of a block, when they fit,
+// from straddling a boundary of SMALLOC_BANK bytes (a memory bank), so no allocation does.
+
 // allocate memory from the heap
 void *smalloc(unsigned long);
+// allocate a T; in a safe build with a cache entered (__smalloc_enter) the pop from
+// that cache is inlined, and otherwise it is just smalloc -- see safe mode
+// e.g. struct SPRITE *sprite = SMALLOC_OBJ(struct SPRITE);
+#define SMALLOC_OBJ(T) ((T *)__smalloc_obj(sizeof(T)))
+// allocate zeroed memory for count objects of size bytes
+void *scalloc(unsigned long count, unsigned long size);
+// allocate memory from the heap at a multiple of align, a power of two
+void *saligned_alloc(unsigned long align, unsigned long n);
 // free / release memory back to the heap
 void sfree(void*);
+// resize memory from the heap, in place when possible
+// returns NULL (and leaves the memory untouched) when there is not enough memory
+void *srealloc(void*, unsigned long);
+// allocate count objects of size bytes each into out[], in one pass
+// returns how many were allocated -- fewer than count only when memory runs out
+unsigned long smalloc_n(unsigned long size, unsigned long count, void *out[]);
+// free count pointers (NULLs are skipped); ptrs[] is sorted by address
+void sfree_n(void *ptrs[], unsigned long count);
+// allocate memory close to near, a live allocation (from any heap), e.g. the next
+// node of a list: in the same block if there is room, otherwise as smalloc does
+void *smalloc_near(void *near, unsigned long n);
+// allocate memory that is expected to live long or short, e.g. a level asset or
+// a per-frame message. Each lifetime has blocks of its own, so short-lived memory
+// doesn't leave holes between long-lived memory; smalloc is SMALLOC_LONG.
+#define SMALLOC_LONG    0
+#define SMALLOC_SHORT   1
+void *smalloc_hint(unsigned long n, unsigned lifetime);
+// (sfree, sfree_n and srealloc work on memory from any heap, not just the default one)
+
+//////////////////////////////////////////////////////////////////////////
+// heaps: smalloc allocates from a default heap, and more can be made in
+// other memory ranges, e.g. one in fast RAM and one in expansion RAM
+//////////////////////////////////////////////////////////////////////////
+
+struct SHEAP;
+typedef struct SHEAP *smalloc_heap_t;
+
+// make a heap of the memory from bottom to top, allocated in blocks of at least pageSize
+// its book-keeping takes the start of the memory. returns NULL if that is too small,
+// or if any of the memory is another heap's
+smalloc_heap_t sheap_init(unsigned long bottom, unsigned long top, unsigned long pageSize);
+// allocate memory from / free memory back to a heap
+void *sheap_alloc(smalloc_heap_t heap, unsigned long n);
+void sheap_free(smalloc_heap_t heap, void *ptr);
+// forget a heap: its memory, and everything allocated from it, is the caller's again
+void sheap_destroy(smalloc_heap_t heap);
+
+#ifdef SMALLOC_SAFE
+//////////////////////////////////////////////////////////////////////////
+// safe mode: locking and per-context caches
+//////////////////////////////////////////////////////////////////////////
+
+// hooks that take and release exclusive access to the heap
+// lock() returns a state that is handed back to unlock(), e.g. the interrupt
+// mask to restore. NULL hooks (the default) do nothing.
+void __smalloc_set_lock(unsigned (*lock)(void), void (*unlock)(unsigned));
+
+#ifndef SMALLOC_CACHE_CLASSES
+#define SMALLOC_CACHE_CLASSES 16    // smallest chunk sizes that are cached
+#endif
+#ifndef SMALLOC_CACHE_DEPTH
+#define SMALLOC_CACHE_DEPTH 8       // chunks cached per size
+#endif
+
+// the size of a CHUNK header, padded to SMALLOC_ALIGN, and of the smallest chunk (see
+// smalloc_internal.h, smalloc.c checks that they agree): a header, two free list links and a footer
+#define __SMALLOC_WORDS(n)      (((n) + sizeof(unsigned long) - 1) / sizeof(unsigned long) * sizeof(unsigned long))
+#define __SMALLOC_ALIGN_UP(n)   (((n) + SMALLOC_ALIGN - 1) / SMALLOC_ALIGN * SMALLOC_ALIGN)
+#ifdef SMALLOC_COMPACT
+#define __SMALLOC_CHUNK         sizeof(unsigned long)
+#else
+#define __SMALLOC_CHUNK         __SMALLOC_WORDS(sizeof(void *) + sizeof(unsigned long) + sizeof(unsigned))
+#endif
+#ifdef SMALLOC_DEBUG
+#define __SMALLOC_CHUNK_STRUCT  (__SMALLOC_CHUNK + 2 * sizeof(unsigned long))
+#define __SMALLOC_CANARY        sizeof(unsigned long)
+#else
+#define __SMALLOC_CHUNK_STRUCT  __SMALLOC_CHUNK
+#define __SMALLOC_CANARY        0
+#endif
+#define __SMALLOC_CHUNK_SZ      __SMALLOC_ALIGN_UP(__SMALLOC_CHUNK_STRUCT)
+#define __SMALLOC_MIN_CHUNK     __SMALLOC_ALIGN_UP(__SMALLOC_CHUNK_STRUCT + 2 * sizeof(void *) + sizeof(unsigned long))
+
+// the class of the smallest chunk: smaller requests are given one, so they share its class
+#define SMALLOC_MIN_CLASS       ((__SMALLOC_MIN_CHUNK - __SMALLOC_CHUNK_SZ - __SMALLOC_CANARY) / SMALLOC_ALIGN)
+
+// the cache class of an n-byte request: class c holds chunks with room for
+// c * SMALLOC_ALIGN bytes, so a constant n gives a constant class
+#define SMALLOC_CLASS(n) ((n) <= SMALLOC_MIN_CLASS * SMALLOC_ALIGN ? SMALLOC_MIN_CLASS : ((n) + SMALLOC_ALIGN - 1) / SMALLOC_ALIGN)
+
+// the payload of a cached chunk
+struct SCACHED {
+    struct SCACHED *next;
+    struct SCACHE *cache;               // the cache it is in, to catch double frees
+};
+
+// a cache of recently freed small chunks for one context (task, IRQ level, thread)
+// used by smalloc/sfree without the lock - zero-initialize before use
+struct SCACHE {
+    struct SCACHED *head[SMALLOC_CACHE_CLASSES];
+    unsigned char count[SMALLOC_CACHE_CLASSES];
+    unsigned long allocations;          // allocations it has served, for __smalloc_stats
+    struct SCACHE *next;                // the caches __smalloc_stats counts, from __smalloc_enter
+    unsigned char listed;               // it is in that list, until __smalloc_flush
+};
+
+// the current context's cache, per thread if SMALLOC_TLS is e.g. _Thread_local
+#ifndef SMALLOC_TLS
+#define SMALLOC_TLS
+#endif
+extern SMALLOC_TLS struct SCACHE* __smalloc_context;
+
+// make cache the current context's cache (NULL for none), returns the previous one
+struct SCACHE* __smalloc_enter(struct SCACHE* cache);
+// give all the chunks in a cache back to the heap
+void __smalloc_flush(struct SCACHE* cache);
+
+#if !defined(SMALLOC_DEBUG) && !defined(SMALLOC_TRACE)
+// SMALLOC_OBJ's fast path: pop from the current context's cache inline, and
+// only call smalloc when it has nothing of that class
+static inline void *__smalloc_obj(unsigned long n) {
+    struct SCACHE *cache = __smalloc_context;
+    struct SCACHED *cached;
+    if(n <= (SMALLOC_CACHE_CLASSES - 1) * SMALLOC_ALIGN && cache && (cached = cache->head[SMALLOC_CLASS(n)])) {
+        cache->head[SMALLOC_CLASS(n)] = cached->next;
+        cache->count[SMALLOC_CLASS(n)]--;
+        cache->allocations++;
+        cached->cache = 0;
+        return cached;
+    }
+    return smalloc(n);
+}
+#define __SMALLOC_OBJ_INLINE
+#endif
+#endif
+
+#ifndef __SMALLOC_OBJ_INLINE
+// no cache outside safe mode, and debug and trace builds see every allocation in smalloc,
+// so SMALLOC_OBJ is no faster than smalloc there
+#define __smalloc_obj(n) smalloc(n)
+#endif
+
+// Build with SMALLOC_RT for a bounded worst case in smalloc and sfree (see the readme)
+
+#ifdef SMALLOC_DEFER
+//////////////////////////////////////////////////////////////////////////
+// deferred mode: sfree only queues the memory, which is binned later
+//////////////////////////////////////////////////////////////////////////
+
+// give every pending sfree'd chunk back to its heap, e.g. when the CPU is idle
+// (the next allocation that reaches a heap drains that heap anyway)
+void __smalloc_drain(void);
+#endif
+
+#ifdef SMALLOC_DEBUG
+//////////////////////////////////////////////////////////////////////////
+// debug mode: magic words, canaries, poisoning and heap checks
+//////////////////////////////////////////////////////////////////////////
+
+// hook that is told about every problem found, e.g. a double free
+// ptr is the pointer, chunk or block at fault. NULL (the default) ignores them,
+// and a bad pointer given to sfree or srealloc is left alone either way.
+void __smalloc_set_fault(void (*fault)(const char* what, void* ptr));
+
+// walk the whole heap and check it, returns the number of problems found
+int __smalloc_check(void);
+#endif
+
+#ifdef SMALLOC_TRACE
+//////////////////////////////////////////////////////////////////////////
+// trace mode: a ring buffer of allocation records
+//////////////////////////////////////////////////////////////////////////
+
+#ifndef SMALLOC_TRACE_RING
+#define SMALLOC_TRACE_RING 256      // records kept until they are read
+#endif
+
+// one traced smalloc/srealloc/sfree, 16 bytes with 32-bit pointers (24 with 64-bit)
+// every field is little-endian, so a dump reads the same on any host
+struct STRACE {
+    unsigned char op;               // 'a' smalloc, 'r' srealloc, 'f' sfree
+    unsigned char size[3];          // bytes asked for, at most 0xffffff
+    unsigned char tick[4];          // from the tick hook, or the record number without one
+    unsigned char ptr[sizeof(void *)];  // the pointer returned (or freed), in full
+    unsigned char old[sizeof(void *)];  // srealloc: the pointer it was given
+};
+
+// hooks: tick() timestamps records, e.g. with a frame counter, and sink() is
+// handed each record as it is made, e.g. to send it over serial.
+// Both are called with the lock held; NULL (the default) for neither.
+void __smalloc_set_trace(unsigned long (*tick)(void), void (*sink)(const struct STRACE *record));
+
+// copy up to max of the oldest unread records into out, returns how many
+// *lost is the number of records overwritten before they could be read
+unsigned long __smalloc_trace_read(struct STRACE *out, unsigned long max, unsigned long *lost);
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 // some low level calls for diagnostics, testing, and tuning
@@ -32,11 +235,86 @@ void sfree(void*);
 // set the heap memory boundaries and default block allocation size
 // WARNING: this will reallocate initial structures and book-keeping values
 // DON'T CALL THIS OR ONLY CALL THIS ONCE AT THE BEGINNING OF YOUR PROGRAM
-void __smalloc_init(unsigned long bottom, unsigned long top, unsigned long pageSize);
+// returns 0 if the memory can't hold a block: the heap is then left with no memory
+int __smalloc_init(unsigned long bottom, unsigned long top, unsigned long pageSize);
+
+// a page source, for a default heap whose memory is reserved but not yet usable
+// commit makes size bytes from addr usable (returns 0 if it can't) and release gives
+// them back; the heap grows and shrinks in pageSize steps. Set before __smalloc_init,
+// and set NULL hooks (the default) for plain memory.
+void __smalloc_set_pages(int (*commit)(void *addr, unsigned long size), void (*release)(void *addr, unsigned long size));
+
+// tell the default heap that its memory past the last block is all zero, e.g. cleared
+// by a DMA fill at init (and that the page source, if any, commits zeroed memory)
+// scalloc then only clears memory that has been used before
+void __smalloc_set_zeroed(void);
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SMALLOC_MMAP
+// hosted builds: reserve size bytes of address space with mmap and set up the
+// default heap in it, committing and releasing its pages as it grows and shrinks
+// (fresh pages are zero, so scalloc knows not to clear them)
+// returns 0 if the space can't be reserved (the heap is left as it was) or can't hold
+// a block (the heap is then left with no memory). Calling it again starts a new heap.
+int __smalloc_init_mmap(unsigned long size, unsigned long pageSize);
+#endif
+
+// heap statistics, maintained as the heap changes -- reading them is O(1)
+// chunk byte counts are inclusive of CHUNK headers
+struct SMALLOC_STATS {
+    unsigned long blocks;           // number of blocks
+    unsigned long heap;             // bytes in all blocks, inclusive of BLOCK headers
+    unsigned long inUse;            // bytes in allocated chunks
+    unsigned long inFree;           // bytes in freed chunks
+    unsigned long untouched;        // bytes at the top of blocks not (or no longer) carved into chunks
+    unsigned long inOthers;         // bytes in blocks owned by a spool or sarena
+    unsigned long peakInUse;        // the most inUse has ever been
+    unsigned long allocations;      // number of allocations the heap has made
+    unsigned long live;             // number of allocated chunks
+};
+
+// copy the current heap statistics into *stats
+void __smalloc_stats(struct SMALLOC_STATS *stats);
+
+#ifndef SMALLOC_REPORT_CLASSES
+#define SMALLOC_REPORT_CLASSES 24   // class i counts chunks of 2^i up to 2^(i+1) bytes, the last one all bigger
+#endif
+#ifndef SMALLOC_REPORT_BLOCKS
+#define SMALLOC_REPORT_BLOCKS 32    // blocks that are reported one by one
+#endif
+
+// one block of a heap report
+struct SMALLOC_BLOCK_REPORT {
+    void *block;                    // the block's address
+    unsigned long size;             // bytes in the block, inclusive of its header
+    unsigned long inUse;            // bytes in allocated chunks (all of it for a spool or sarena block)
+    unsigned long inFree;           // bytes in freed chunks
+    unsigned long untouched;        // bytes at the block's top
+    unsigned lifetime;              // SMALLOC_LONG or SMALLOC_SHORT (see smalloc_hint)
+};
+
+// the shape of the heap, from one walk of it
+// chunk byte counts are inclusive of CHUNK headers
+struct SMALLOC_REPORT {
+    unsigned long liveChunks[SMALLOC_REPORT_CLASSES];   // allocated chunks by size class
+    unsigned long liveBytes[SMALLOC_REPORT_CLASSES];
+    unsigned long freeChunks[SMALLOC_REPORT_CLASSES];   // freed chunks by size class
+    unsigned long freeBytes[SMALLOC_REPORT_CLASSES];
+    unsigned long largestFree;      // the biggest freed chunk
+    unsigned long largestTop;       // the most untouched space at the top of one block
+    unsigned fragmentation;         // external fragmentation, per mille: 1000 * (1 - largest / all free space)
+                                    // counting freed chunks and block tops; 0 when there is none
+    unsigned long blocks;           // number of blocks; the first SMALLOC_REPORT_BLOCKS are in block[]
+    struct SMALLOC_BLOCK_REPORT block[SMALLOC_REPORT_BLOCKS];
+};
+
+// walk the heap and fill in *report
+void __smalloc_report(struct SMALLOC_REPORT *report);
 
 // returns the total number of bytes used by smalloc internals (including smalloc'd data)
 // *numBlocks = the number of blocks allocated
 // *inBlocks = the number of bytes used, inclusive of headers and smalloc'd memory
+// (the blocks of a spool or sarena count as used in full)
 unsigned long __smalloc_used(unsigned short *numBlocks, unsigned long *inBlocks);
 
 // returns the available memory
@@ -45,7 +323,20 @@ unsigned long __smalloc_used(unsigned short *numBlocks, unsigned long *inBlocks)
 // *inFree is the memory in previously freed chunks
 unsigned long __smalloc_avail(unsigned long *inBlocks, unsigned long *inFree);
 
+// point __smalloc_stats, __smalloc_report, __smalloc_used, __smalloc_avail, __smalloc_check
+// and the calls below at another heap, or back at the default heap with NULL
+// -- this is used for diagnostics and testing only
+void __smalloc_diagnose(smalloc_heap_t heap);
+
 // returns the first block -- this is used for diagnostics and testing only
 void *__smalloc_first_block(void);
 
+// the heap's memory: from the bottom, where its first block goes (past the
+// pagemap of a SMALLOC_COMPACT build), to top -- this is used for diagnostics and testing only
+void __smalloc_bounds(void **bottom, void **top);
+
+// calls visit with every freed chunk in the heap's bins and the lifetime
+// of the bins it is in -- this is used for testing only
+void __smalloc_visit_bins(void (*visit)(void *chunk, unsigned lifetime));
+
 #endif
\ No newline at end of file
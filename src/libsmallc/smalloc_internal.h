@@ -0,0 +1,167 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+#ifndef __SMALLOC_INTERNAL_H
+#define __SMALLOC_INTERNAL_H
+
+// smalloc internals shared by the allocators built on top of BLOCKs
+// THESE ARE NOT PART OF THE PUBLIC API
+
+#ifndef NULL
+#define NULL 0
+#endif
+
+#include "smalloc.h"
+
+#undef SIZE_T
+#define SIZE_T unsigned long
+
+// Every CHUNK, FREED and BLOCK is aligned to SMALLOC_ALIGN (see smalloc.h) too.
+
+// SMALLOC_LOCK()/SMALLOC_UNLOCK() bracket every access to shared heap state
+// they compile to nothing unless built with SMALLOC_SAFE
+#ifdef SMALLOC_SAFE
+extern unsigned (*__smalloc_lock)(void);
+extern void (*__smalloc_unlock)(unsigned);
+#define SMALLOC_LOCK()      unsigned __lockState = __smalloc_lock ? __smalloc_lock() : 0
+#define SMALLOC_UNLOCK()    if(__smalloc_unlock) __smalloc_unlock(__lockState)
+#else
+#define SMALLOC_LOCK()
+#define SMALLOC_UNLOCK()
+#endif
+
+#define ALIGN_UP(n, align)         (((SIZE_T)(n) + (align) - 1) & ~(SIZE_T)((align) - 1))
+
+#define ALLOCD 1
+#define PREVFREE 2      // the chunk physically before this one is free (and has a footer)
+
+// struct CHUNK is the header of a non-free and free allocation
+// within a block. if CHUNK is at memory M, the "user" (program)
+// receives the address to memory, M + CHUNK_HEADER_SZ.
+// Chunk sizes are always a multiple of SMALLOC_ALIGN.
+// Built with SMALLOC_COMPACT, the header is a single word: the flags live in
+// the low bits of the size, and the block is found from the chunk's address.
+// Use the accessors below rather than the fields.
+struct CHUNK {
+#ifdef SMALLOC_COMPACT
+    SIZE_T head;    // total size, inclusive of the CHUNK header | flags
+#else
+    void *block;
+    SIZE_T size;    // total size, inclusive of the CHUNK header
+    unsigned flags; 
+#endif
+#ifdef SMALLOC_DEBUG
+    SIZE_T magic;   // CHUNK_LIVE or CHUNK_DEAD
+    SIZE_T request; // the bytes asked for -- canary bytes fill the rest of the chunk
+#endif
+};
+
+// SMALLOC_DEBUG builds tag every chunk and leave room for canary bytes
+// past every request; otherwise none of it exists
+#ifdef SMALLOC_DEBUG
+#define CHUNK_LIVE  0x5a110c3dUL    // handed out by smalloc
+#define CHUNK_DEAD  0xdeadf4eeUL    // freed, or waiting in a cache
+#define CANARY_SZ   sizeof(SIZE_T)
+#else
+#define CANARY_SZ   0
+#endif
+
+// struct FREED is a struct CHUNK + pointers to maintain
+// a doubly-linked list of free CHUNKs - the pointers live
+// in what was the program data area.
+// The last SIZE_T of a FREED is a footer that repeats its size so that
+// the following chunk can find the start of it (see PREVFREE).
+// This data structure + footer defines the minimum allocatable
+// size of any CHUNK returned by smalloc.
+struct FREED {
+    struct CHUNK header;
+    struct FREED* next;
+    struct FREED* prev;
+};
+
+#ifdef SMALLOC_COMPACT
+// the flags live in the low two bits of the size, so sizes must be multiples of 4
+typedef char __smalloc_compact_needs_align_4[SMALLOC_ALIGN >= 4 ? 1 : -1];
+#define CHUNK_FLAG_BITS         (ALLOCD | PREVFREE)
+#define CHUNK_SIZE(c)           ((c)->head & ~(SIZE_T)CHUNK_FLAG_BITS)
+#define CHUNK_FLAGS(c)          ((unsigned)((c)->head & CHUNK_FLAG_BITS))
+#define SET_SIZE(c, s)          ((c)->head = (s) | CHUNK_FLAGS(c))
+#define SET_FLAGS(c, f)         ((c)->head = CHUNK_SIZE(c) | (f))
+#define SET_FLAG(c, f)          ((c)->head |= (f))
+#define CLEAR_FLAG(c, f)        ((c)->head &= ~(SIZE_T)(f))
+#define CHUNK_BLOCK(c)          __block_of(c)
+#define SET_BLOCK(c, b)
+#else
+#define CHUNK_SIZE(c)           ((c)->size)
+#define CHUNK_FLAGS(c)          ((c)->flags)
+#define SET_SIZE(c, s)          ((c)->size = (s))
+#define SET_FLAGS(c, f)         ((c)->flags = (f))
+#define SET_FLAG(c, f)          ((c)->flags |= (f))
+#define CLEAR_FLAG(c, f)        ((c)->flags &= ~(f))
+#define CHUNK_BLOCK(c)          ((struct BLOCK *)(c)->block)
+#define SET_BLOCK(c, b)         ((c)->block = (b))
+#endif
+
+#define CHUNK_HEADER_SZ            ALIGN_UP(sizeof(struct CHUNK), SMALLOC_ALIGN)
+
+#define FOOTER(chunk)           (*(SIZE_T *)((void *)(chunk) + CHUNK_SIZE(chunk) - sizeof(SIZE_T)))
+
+// struct BLOCK maintains a doubly-linked list of BLOCKs
+// It also maintains a pointer, top, to the next memory space to allocate the next chunk in itself.
+// It maintains some size information to make new allocations and reporting easy.
+struct BLOCK {
+    struct BLOCK* prev;             // previous block, i.e., towards __first_block
+    struct BLOCK* next;             // next block, i.e., towards __last_block
+    SIZE_T size;                    // size of the entire block: header and space for CHUNKs
+    SIZE_T remaining;               // remaining bytes that can be allocated by smalloc in block
+    void*  top;                     // where to start allocating new smalloc requests
+    unsigned kind;                  // what the block's space is used for, BLOCK_CHUNKS etc.
+    unsigned lifetime;              // the chunks it holds, SMALLOC_LONG or SMALLOC_SHORT
+    struct BLOCK* roomNext;         // next block with about as much room (see __rooms)
+    struct BLOCK* roomPrev;         // previous block with about as much room
+    void*  zeroed;                  // the memory from here to the end of the block is known to be zero
+};
+// 40-byte header on 8K default allocation size is 0.5% overhead
+
+// A block's space is normally tiled with CHUNKs up to top. Other allocators
+// (e.g. spool, sarena) claim whole blocks with __claim_block and manage the space themselves.
+#define BLOCK_CHUNKS    0
+#define BLOCK_POOL      1
+#define BLOCK_ARENA     2
+
+// lifetimes a CHUNK block can be for (see smalloc_hint)
+#define LIFETIMES       2
+
+#define BLOCK_HEADER_SZ            ALIGN_UP(sizeof(struct BLOCK), SMALLOC_ALIGN)
+
+// the chunk size for an n-byte request, inclusive of its header; 0 if n is impossibly large
+SIZE_T __chunk_size(SIZE_T n);
+struct BLOCK* __new_block(SIZE_T requestedSize);
+struct BLOCK* __claim_block(SIZE_T requestedSize, unsigned kind);
+void __release_block(struct BLOCK* block);
+void __free_chunk(struct CHUNK* chunk);
+void __trim_chunk(struct CHUNK* chunk, SIZE_T size);
+void* __slide_chunk(void* ptr);
+void* __lower_chunk(void* ptr, void* limit);
+struct BLOCK* __heap_first_block(void);     // the current heap's, with the lock held
+#ifdef SMALLOC_COMPACT
+struct BLOCK* __block_of(void* ptr);
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+#include "smalloc.h"
+
+#ifdef SMALLOC_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+  A page source for hosted builds (tests, benchmarks): the default heap is an
+  mmap reservation of inaccessible address space, so the BLOCK and CHUNK code
+  is the same as on bare metal. Pages are made accessible (mprotect) as the
+  heap grows, and dropped (by mapping them again, inaccessible) as empty
+  BLOCKs at its end are released.
+*/
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define RESERVE_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE)
+
+static void* __reserved = NULL;
+static unsigned long __reservedSize = 0;
+
+// Make the OS pages holding addr .. addr + size usable
+static int __mmap_commit(void* addr, unsigned long size) {
+    unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long start = (unsigned long)addr & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + size + page - 1) & ~(page - 1);
+    return !mprotect((void *)start, end - start, PROT_READ | PROT_WRITE);
+}
+
+// Drop the OS pages that are wholly within addr .. addr + size
+static void __mmap_release(void* addr, unsigned long size) {
+    unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + size) & ~(page - 1);
+    if(start >= end) return;
+    mmap((void *)start, end - start, PROT_NONE, RESERVE_FLAGS | MAP_FIXED, -1, 0);
+}
+
+int __smalloc_init_mmap(unsigned long size, unsigned long pageSize) {
+    void* reserved = mmap(NULL, size, PROT_NONE, RESERVE_FLAGS, -1, 0);
+    if(reserved == MAP_FAILED) return 0; // the old heap, if any, is still there
+    __smalloc_set_pages(__mmap_commit, __mmap_release);
+    int ok = __smalloc_init((unsigned long)reserved, (unsigned long)reserved + size - 1, pageSize);
+    // the old heap is gone either way
+    if(__reserved) munmap(__reserved, __reservedSize);
+    __reserved = NULL;
+    __reservedSize = 0;
+    if(!ok) {
+        munmap(reserved, size);
+        __smalloc_set_pages(NULL, NULL);
+        return 0;
+    }
+    __reserved = reserved;
+    __reservedSize = size;
+    __smalloc_set_zeroed(); // anonymous pages start out zero, and so do released ones
+    return 1;
+}
+#endif
@@ -0,0 +1,136 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+#include "spool.h"
+#include "smalloc.h"
+#include "smalloc_internal.h"
+
+/*
+  "spool" - fixed-size object pools
+
+- A pool claims whole BLOCKs from the heap (__claim_block) as BLOCK_POOL,
+  so smalloc never carves CHUNKs out of them.
+- Each pool block starts with a SEGMENT link, followed by slots of objSize.
+  Slots are SMALLOC_ALIGN aligned, like smalloc pointers.
+- Slots are handed out by bumping through the newest block (fresh .. end),
+  and recycled through an intrusive singly-linked free list: a free slot
+  holds the pointer to the next free slot.
+- Objects have no header; the caller tells spool_free which pool to use.
+- A pool is not locked (SMALLOC_SAFE); only taking blocks from the heap is.
+*/
+
+// struct SEGMENT is the start of every pool block's space,
+// chaining the blocks of a pool together
+struct SEGMENT {
+    struct BLOCK* next;
+};
+
+struct SPOOL {
+    SIZE_T objSize;             // slot size, a multiple of SMALLOC_ALIGN
+    SIZE_T perBlock;            // minimum number of slots in each block
+    struct BLOCK* blocks;       // most recently added block first
+    void* free;                 // singly-linked list of released slots
+    void* fresh;                // next never-used slot in the newest block
+    void* end;                  // end of the newest block
+};
+
+#define SEGMENT_SZ      ALIGN_UP(sizeof(struct SEGMENT), SMALLOC_ALIGN)
+
+// Add a block with room for at least perBlock slots to the pool
+static int __spool_grow(struct SPOOL* pool) {
+    SMALLOC_LOCK();
+    struct BLOCK* block = __claim_block(SEGMENT_SZ + pool->objSize * pool->perBlock, BLOCK_POOL);
+    SMALLOC_UNLOCK();
+    if(!block) return 0;
+
+    // the whole block belongs to the pool -- keep smalloc out of it
+    block->top = (void *)block + block->size;
+    block->remaining = 0;
+
+    struct SEGMENT* segment = (void *)block + BLOCK_HEADER_SZ;
+    segment->next = pool->blocks;
+    pool->blocks = block;
+    pool->fresh = (void *)segment + SEGMENT_SZ;
+    pool->end = block->top;
+    return 1;
+}
+
+struct SPOOL *spool_create(SIZE_T objSize, SIZE_T perBlock) {
+    if(!objSize || !perBlock) return NULL;
+
+    struct SPOOL* pool = smalloc(sizeof(struct SPOOL));
+    if(!pool) return NULL;
+
+    // a free slot must hold the free-list link, and slots stay aligned
+    if(objSize < sizeof(void *)) objSize = sizeof(void *);
+    pool->objSize = ALIGN_UP(objSize, SMALLOC_ALIGN);
+    pool->perBlock = perBlock;
+    pool->blocks = NULL;
+    pool->free = NULL;
+    pool->fresh = NULL;
+    pool->end = NULL;
+
+    if(!__spool_grow(pool)) {
+        sfree(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void *spool_alloc(struct SPOOL* pool) {
+    void* slot = pool->free;
+    if(slot) {
+        pool->free = *(void **)slot;
+        return slot;
+    }
+    if(pool->fresh + pool->objSize > pool->end && !__spool_grow(pool)) return NULL;
+    slot = pool->fresh;
+    pool->fresh += pool->objSize;
+    return slot;
+}
+
+void spool_free(struct SPOOL* pool, void* slot) {
+    if(!slot) return;
+    *(void **)slot = pool->free;
+    pool->free = slot;
+}
+
+// Whether obj is a slot of one of the pool's blocks
+int spool_owns(struct SPOOL* pool, void* obj) {
+    for(struct BLOCK* block = pool->blocks; block; block = ((struct SEGMENT *)((void *)block + BLOCK_HEADER_SZ))->next) {
+        void* slots = (void *)block + BLOCK_HEADER_SZ + SEGMENT_SZ;
+        if(obj < slots || obj + pool->objSize > (void *)block + block->size) continue;
+        return (SIZE_T)(obj - slots) % pool->objSize == 0;
+    }
+    return 0;
+}
+
+// Hand every pool block back to smalloc as an empty CHUNK block
+void spool_destroy(struct SPOOL* pool) {
+    SMALLOC_LOCK();
+    struct BLOCK* block = pool->blocks;
+    while(block) {
+        struct SEGMENT* segment = (void *)block + BLOCK_HEADER_SZ;
+        struct BLOCK* next = segment->next;
+        __release_block(block);
+        block = next;
+    }
+    SMALLOC_UNLOCK();
+    sfree(pool);
+}
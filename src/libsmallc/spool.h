@@ -0,0 +1,39 @@
+/*
+Copyright 2022 John A Magdaleno (johnamagdaleno@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the "Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the
+following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+*/
+
+#ifndef __SPOOL_H
+#define __SPOOL_H
+
+// A pool of fixed-size objects carved out of whole smalloc BLOCKs.
+// Objects have no per-object header; alloc and free are O(1).
+struct SPOOL;
+
+// create a pool of objSize objects, growing perBlock objects at a time
+// returns NULL if there is not enough memory for the first block
+struct SPOOL *spool_create(unsigned long objSize, unsigned long perBlock);
+// allocate an object from the pool, NULL if the pool cannot grow
+void *spool_alloc(struct SPOOL*);
+// return an object to the pool it was allocated from
+void spool_free(struct SPOOL*, void*);
+// whether obj is the address of one of the pool's slots (in use or not)
+int spool_owns(struct SPOOL*, void *obj);
+// release the pool; its blocks become ordinary smalloc space
+void spool_destroy(struct SPOOL*);
+
+#endif
\ No newline at end of file
@@ -1,10 +1,21 @@
 #include "strlen.h"
+#include "memword.h"
 
+// Scan bytes until s is word aligned, then a word at a time until a word
+// contains the terminator, then bytes again within that word.
+// An aligned word never spans two pages, so reading the whole word that
+// holds the terminator can't fault even though it reads past the string.
 unsigned long strlen(const char* s) {
-    unsigned long count = 0;
-    while(*s) {
-        count++;
-        s++;
+    const char* p = s;
+    while(!MEM_ALIGNED(p)) {
+        if(!*p) return p - s;
+        p++;
     }
-    return count;
+
+    const MEM_WORD* w = (const MEM_WORD *)p;
+    while(!MEM_HAS_ZERO(*w)) w++;
+
+    p = (const char *)w;
+    while(*p) p++;
+    return p - s;
 }
\ No newline at end of file
@@ -17,127 +17,1203 @@ CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFT
 IN THE SOFTWARE.
 */
 
+// smalloc_test: allocation stress and regression tests
+// Random smalloc/sfree/srealloc steps are checked against a shadow model of what
+// should be allocated, under several __smalloc_init configurations, and the whole
+// heap is walked and checked after every step. Exits non-zero if anything is wrong.
+
 #include "libsmallc/smalloc.h"
+#include "libsmallc/smalloc_internal.h"
+#include "libsmallc/spool.h"
+#include "libsmallc/sarena.h"
+#include "libsmallc/shandle.h"
+#include "libsmallc/memcpy.h"
+#include "libsmallc/memmove.h"
+#include "libsmallc/memset.h"
+#include "libsmallc/memcmp.h"
+#include "libsmallc/strlen.h"
+#include "libsmallc/memword.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-// THESE ARE INTERNALS VVVV
+#define SLOTS   256     // allocations the shadow model keeps track of
+#define STEPS   3000UL   // random steps per configuration
+#define BATCH   16      // most pointers handed to smalloc_n / sfree_n at once
+#define HANDLES 96      // handles the compaction test makes
 
-#undef SIZE_T
-#define SIZE_T unsigned long
+// how a heap to test is set up
+#define HEAP_ZEROED     1   // the memory is cleared first, and __smalloc_set_zeroed told
+#define HEAP_MMAP       2   // the memory is reserved by __smalloc_init_mmap
+#define HEAP_SHEAP      4   // a second heap, made with sheap_init, serves some of the allocations
 
-// struct CHUNK is the header of a non-free and free allocation
-// within a block
-struct CHUNK {
-    void *block;
-    SIZE_T size;    // total size, inclusive of the CHUNK header
-    unsigned flags; 
+// a heap to test: its size, block size and how far its bottom is off alignment
+struct CONFIG {
+    unsigned long size;
+    unsigned long pageSize;
+    unsigned long offset;
+    unsigned flags;
 };
 
-// struct FREED is a struct CHUNK + pointers to maintain
-// doubly-linked list of free CHUNKs - the pointers live
-// in what was the program data area.
-struct FREED {
-    struct CHUNK header;
-    struct FREED* next;
-    struct FREED* prev;
+static const struct CONFIG configs[] = {
+    { 256 << 10, 1 << 10, 0, 0 },   // lots of small blocks
+    { 64 << 10, 256, 3, 0 },        // tiny blocks and a misaligned bottom
+    { 256 << 10, 4 << 10, 8, 0 },
+    { 1 << 20, 8 << 10, 0, 0 },     // the default block size
+    { 200 << 10, 3000, 1, 0 },      // a block size that isn't a power of two
+    { 24 << 10, 8 << 10, 0, 0 },    // room for three blocks: allocations fail often
+    { 512 << 10, 64 << 10, 5, 0 },  // a few big blocks
+    { 256 << 10, 4 << 10, 0, HEAP_ZEROED }, // scalloc only clears memory that was used
+    { 256 << 10, 2 << 10, 4, HEAP_SHEAP },  // sfree, srealloc and smalloc_near find the heap
+#ifdef SMALLOC_MMAP
+    { 1 << 20, 8 << 10, 0, HEAP_MMAP }, // pages are committed and released as it grows and shrinks
+#endif
 };
+#define CONFIGS (sizeof(configs) / sizeof(configs[0]))
 
-// struct BLOCK maintains a doubly-linked list of BLOCKs
-// It also maintains a pointer, top, to the next memory space to allocate (upward) in the block.
-// It maintains a pointer to the head of a doubly-linked list of freed chunks.
-// It maintains some size information to make new allocations and reporting easy.
-struct BLOCK {
-    struct BLOCK* prev;             // previous block, i.e., towards __first_block
-    struct BLOCK* next;             // next block, i.e., towards __last_block
-    SIZE_T size;                    // size of the entire block, header and actual space
-    SIZE_T remaining;               // remaining bytes that can be allocated by smalloc in block
-    void*  top;                     // where to start allocating new smalloc requests
-    struct FREED* free;             // recycling is important
+// one allocation the heap should have: every byte of it holds fill
+struct SHADOW {
+    unsigned char *ptr;             // NULL when the slot is empty
+    unsigned long size;             // bytes asked for
+    unsigned char fill;
 };
-// 24-byte header on 8K default allocation size is 0.3% overhead
 
-// THESE ARE INTERNALS ^^^^^^^
+static struct SHADOW shadow[SLOTS];
+static unsigned long shadowLive;    // slots in use
+static unsigned long extraLive;     // allocations made on the test's behalf, e.g. a SPOOL
+
+static char *memory;                // the heap's memory, unless it is mmap'ed
+static void *heapBottom, *heapTop;  // from __smalloc_bounds
+static char *otherMemory;           // the second heap of a HEAP_SHEAP config, or NULL
+static smalloc_heap_t other;
+static void *otherBottom, *otherTop;
+static unsigned long pageSize;
+static const char *testing = "";    // what is being tested, for failure messages
+static unsigned long step;
+static unsigned long failures;
+static unsigned long expectedFaults;  // double frees done on purpose
+
+static void fail(const char *what, void *ptr) {
+    if(failures++ < 20) printf("FAIL %s, step %lu: %s (%p)\n", testing, step, what, ptr);
+}
+
+#define EXPECT(cond, what, ptr)     do { if(!(cond)) fail(what, (void *)(ptr)); } while(0)
+
+#ifdef SMALLOC_DEBUG
+static unsigned long faults;        // problems the debug build reported
 
-void debug_out(void) {
-    unsigned long total, used;
-    unsigned short blocks;
-    total = __smalloc_used(&blocks, &used);
+static void count_fault(const char *what, void *ptr) {
+    (void)what;
+    (void)ptr;
+    faults++;
+}
+#endif
+
+// xorshift32, so every run does the same steps
+static unsigned rnd_state = 2022;
+
+static unsigned rnd(unsigned n) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state % n;
+}
 
-    unsigned long unallocd, inBlocks, inFree;
-    unallocd = __smalloc_avail(&inBlocks, &inFree);
+// mostly small requests, some medium, a few bigger than a block, and some tiny or zero
+static unsigned long rnd_size(void) {
+    unsigned r = rnd(16);
+    if(r < 10) return 1 + rnd(64);
+    if(r < 14) return 65 + rnd(960);
+    if(r < 15) return 1 + rnd(2 * pageSize);
+    return rnd(16);
+}
 
-    printf("stats=[%lu %u %lu]     free=[%lu %lu %lu]\n",
-        total, blocks, used,
-        unallocd, inBlocks, inFree);
+static struct SHADOW *empty_slot(void) {
+    if(shadowLive == SLOTS) return NULL;
+    unsigned i = rnd(SLOTS);
+    while(shadow[i].ptr) i = (i + 1) % SLOTS;
+    return &shadow[i];
 }
 
-void print_heap(void) {
-    struct BLOCK* block = (struct BLOCK*)__smalloc_first_block();
-    printf("__first_block = %p\n", block);
-    while(block) {
-        printf("\nblock = %p     size=%lu remaining=%lu\n", block, block->size, block->remaining);
-        printf("        top=%p free=%p\n", block->top, block->free);
+static struct SHADOW *live_slot(void) {
+    if(!shadowLive) return NULL;
+    unsigned i = rnd(SLOTS);
+    while(!shadow[i].ptr) i = (i + 1) % SLOTS;
+    return &shadow[i];
+}
+
+static void track(struct SHADOW *slot, void *ptr, unsigned long size) {
+    slot->ptr = ptr;
+    slot->size = size;
+    slot->fill = (unsigned char)rnd(256);
+    memset(ptr, slot->fill, size);
+    shadowLive++;
+}
+
+static void untrack(struct SHADOW *slot) {
+    slot->ptr = NULL;
+    shadowLive--;
+}
+
+// the first n bytes of an allocation still hold its fill
+static int intact(struct SHADOW *slot, unsigned long n) {
+    return !n || (slot->ptr[0] == slot->fill && !memcmp(slot->ptr, slot->ptr + 1, n - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// the heap invariant check
+//////////////////////////////////////////////////////////////////////////
+
+// the free chunks found walking the heap, in address order, for the bins to be checked against
+static struct CHUNK **freeChunks;
+static unsigned char *freeBinned;
+static unsigned long freeCount, freeMax;
+static unsigned long binned, binnedBytes;
+
+static void note_free(struct CHUNK *chunk) {
+    if(freeCount == freeMax) {
+        freeMax = freeMax ? 2 * freeMax : 1024;
+        freeChunks = realloc(freeChunks, freeMax * sizeof(struct CHUNK *));
+        freeBinned = realloc(freeBinned, freeMax);
+    }
+    freeBinned[freeCount] = 0;
+    freeChunks[freeCount++] = chunk;
+}
 
-        void *original_top = (void *)block + sizeof(struct BLOCK);
-        printf("        start=%p\n", original_top);
-        struct CHUNK * chunk = (struct CHUNK *)original_top;
+// where a chunk is in freeChunks, or freeCount if it isn't
+static unsigned long find_free(struct CHUNK *chunk) {
+    unsigned long lo = 0, hi = freeCount;
+    while(lo < hi) {
+        unsigned long mid = (lo + hi) / 2;
+        if(freeChunks[mid] < chunk) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < freeCount && freeChunks[lo] == chunk ? lo : freeCount;
+}
+
+static void visit_bin(void *ptr, unsigned lifetime) {
+    struct CHUNK *chunk = ptr;
+    binned++;
+    unsigned long lo = find_free(chunk);
+    if(lo == freeCount) {
+        fail("binned chunk is not a free chunk of the heap", chunk);
+        return;
+    }
+    EXPECT(!freeBinned[lo], "chunk is binned twice", chunk);
+    freeBinned[lo] = 1;
+    binnedBytes += CHUNK_SIZE(chunk);
+    EXPECT(!(CHUNK_FLAGS(chunk) & ALLOCD), "allocated chunk in a bin", chunk);
+    EXPECT(CHUNK_BLOCK(chunk)->lifetime == lifetime, "chunk in the bins of another lifetime", chunk);
+}
+
+// whether ptr is in the second heap
+static int in_other(void *ptr) {
+    return other && ptr >= otherBottom && ptr <= otherTop;
+}
+
+// sheap_init must not make a heap of memory that is already a heap's; if it does,
+// forget that heap again before it is used (none of the memory is another heap's
+// SHEAP, or any of its blocks, so the other heap stays as it was)
+static void refuse_heap(void *bottom, void *top, unsigned long page, const char *what) {
+    smalloc_heap_t heap = sheap_init((unsigned long)bottom, (unsigned long)top, page);
+    EXPECT(!heap, what, bottom);
+    if(heap) sheap_destroy(heap);
+}
+
+// set up the default heap that a test runs in, and note its bounds for check_heap
+static void init_heap(unsigned long size, unsigned long offset, unsigned long page, unsigned flags) {
+    pageSize = page;
+    memory = NULL;
+#ifdef SMALLOC_MMAP
+    if(flags & HEAP_MMAP) {
+        if(!__smalloc_init_mmap(size, page)) fail("__smalloc_init_mmap failed", NULL);
+        __smalloc_bounds(&heapBottom, &heapTop);
+        return;
+    }
+    __smalloc_set_pages(NULL, NULL);
+#endif
+    memory = malloc(size + offset);
+    void *bottom = memory + offset, *top = bottom + size - 1;
+    if(flags & HEAP_ZEROED) memset(memory, 0, size + offset);
+    __smalloc_init((unsigned long)bottom, (unsigned long)top, page);
+    if(flags & HEAP_ZEROED) __smalloc_set_zeroed();
+    __smalloc_bounds(&heapBottom, &heapTop);
+    EXPECT(heapTop == top, "__smalloc_bounds: wrong top", heapTop);
+#ifndef SMALLOC_COMPACT
+    EXPECT(heapBottom == (void *)ALIGN_UP(bottom, SMALLOC_ALIGN), "__smalloc_bounds: wrong bottom", heapBottom);
+#else
+    EXPECT(heapBottom > bottom && heapBottom < top, "__smalloc_bounds: wrong bottom", heapBottom);
+#endif
+    if(!(flags & HEAP_SHEAP)) return;
+
+    // the second heap is the top half of its memory: no heap may overlap another,
+    // but one may start right below another's
+    unsigned long half = size / 2;
+    otherMemory = malloc(2 * half);
+    char *lower = otherMemory, *upper = otherMemory + half;
+    refuse_heap(memory, top, page, "sheap_init of the default heap's memory worked");
+    refuse_heap(bottom + half, top, page, "sheap_init of part of the default heap worked");
+    other = sheap_init((unsigned long)upper, (unsigned long)upper + half - 1, page);
+    EXPECT(other, "sheap_init failed", upper);
+    refuse_heap(upper + half / 2, upper + half - 1, page, "sheap_init of the top of a heap worked");
+    refuse_heap(lower, upper + 64, page, "sheap_init over the start of a heap worked");
+    smalloc_heap_t below = sheap_init((unsigned long)lower, (unsigned long)upper - 1, page);
+    EXPECT(below, "sheap_init right below another heap failed", lower);
+    sheap_destroy(below);
+    __smalloc_diagnose(other);
+    __smalloc_bounds(&otherBottom, &otherTop);
+    __smalloc_diagnose(NULL);
+    EXPECT(otherTop == upper + half - 1, "__smalloc_bounds: wrong top", otherTop);
+}
+
+// put a HEAP_SHEAP config's second heap away
+static void put_away_heap(void) {
+    if(!other) return;
+    sheap_destroy(other);
+    free(otherMemory);
+    other = NULL;
+    otherMemory = NULL;
+}
+
+// Walk the heap and check that
+// - the blocks are contiguous from the bottom of the heap and doubly linked
+// - chunk sizes tile each block up to its top, and PREVFREE and footers are right
+// - the bins hold exactly the free chunks, none of them ALLOCD
+// - memory past each block's zeroed mark is all zero
+// - the statistics add up to what was found, and match the shadow model
+// - every allocation the shadow model has is ALLOCD, big enough and untouched
+// bottom .. top is the heap __smalloc_diagnose points at, and extra its allocations
+// that the shadow model doesn't have
+static void check_one_heap(void *bottom, void *top, unsigned long extra) {
+    unsigned long blocks = 0, heap = 0, inUse = 0, inFree = 0, untouched = 0, inOthers = 0, live = 0;
+    freeCount = 0;
+    static struct SMALLOC_REPORT walked; // what __smalloc_report should find
+    memset(&walked, 0, sizeof(walked));
+
+    struct BLOCK *block = __smalloc_first_block();
+    // nothing may sit between the bottom of the heap and the first block
+    EXPECT(!block || (void *)block == bottom, "first block is not at the bottom", block);
+    struct BLOCK *prev = NULL;
+    void *expected = block;
+    for(; block; prev = block, block = block->next) {
+        void *end = (void *)block + block->size;
+        if((void *)block != expected || block->prev != prev || (unsigned long)block % SMALLOC_ALIGN ||
+            block->size < BLOCK_HEADER_SZ || end > top + 1) {
+            fail("block chain is not contiguous", block);
+            return;
+        }
+        expected = end;
+        struct SMALLOC_BLOCK_REPORT *summary = blocks < SMALLOC_REPORT_BLOCKS ? &walked.block[blocks] : NULL;
+        if(summary) {
+            summary->block = block;
+            summary->size = block->size;
+            summary->lifetime = block->lifetime;
+        }
+        blocks++;
+        heap += block->size;
+        if(block->kind != BLOCK_CHUNKS) {
+            inOthers += block->size;
+            if(summary) summary->inUse = block->size - BLOCK_HEADER_SZ;
+            continue;
+        }
+
+        if(block->top < (void *)block + BLOCK_HEADER_SZ || block->top > end || block->remaining != (unsigned long)(end - block->top)) {
+            fail("bad block top", block);
+            continue;
+        }
+        untouched += block->remaining;
+        if(summary) summary->untouched = block->remaining;
+        if(block->remaining > walked.largestTop) walked.largestTop = block->remaining;
+        // memory past the block's zeroed mark has never been used
+        if(block->zeroed < block->top || block->zeroed > end) fail("bad zeroed mark", block);
+        else {
+            for(unsigned char *p = block->zeroed; p < (unsigned char *)end; p++) {
+                if(*p) {
+                    fail("memory past the zeroed mark is not zero", p);
+                    break;
+                }
+            }
+        }
+        int prevFree = 0;
+        struct CHUNK *chunk = (void *)block + BLOCK_HEADER_SZ;
         while((void *)chunk < block->top) {
-            printf("        chunk=%p (%lu)\n", chunk, chunk->size);
-            void *addr = (void *)chunk;
-            //if(!chunk->size) break;
-            chunk = (struct CHUNK *)(addr + chunk->size);
+            unsigned long size = CHUNK_SIZE(chunk);
+            if(CHUNK_BLOCK(chunk) != block || !size || size % SMALLOC_ALIGN || (void *)chunk + size > block->top) {
+                fail("chunks don't tile the block up to top", chunk);
+                break;
+            }
+            EXPECT(!(CHUNK_FLAGS(chunk) & PREVFREE) == !prevFree, "bad PREVFREE flag", chunk);
+            unsigned c = 0; // the size class: the highest bit, or the last class
+            while(c < SMALLOC_REPORT_CLASSES - 1 && size >> (c + 1)) c++;
+            if(CHUNK_FLAGS(chunk) & ALLOCD) {
+                live++;
+                inUse += size;
+                walked.liveChunks[c]++;
+                walked.liveBytes[c] += size;
+                if(summary) summary->inUse += size;
+                prevFree = 0;
+            } else {
+                EXPECT(!prevFree, "free chunks not coalesced", chunk);
+                EXPECT(FOOTER(chunk) == size, "bad footer", chunk);
+                inFree += size;
+                walked.freeChunks[c]++;
+                walked.freeBytes[c] += size;
+                if(summary) summary->inFree += size;
+                if(size > walked.largestFree) walked.largestFree = size;
+                note_free(chunk);
+                prevFree = 1;
+            }
+            chunk = (void *)chunk + size;
+        }
+        EXPECT(!prevFree, "free chunk below top", block);
+    }
+
+    struct SMALLOC_STATS stats;
+    __smalloc_stats(&stats);
+    EXPECT(stats.blocks == blocks, "stats: wrong block count", blocks);
+    EXPECT(stats.heap == heap, "stats: wrong heap size", heap);
+    EXPECT(stats.inFree == inFree, "stats: wrong bytes in freed chunks", inFree);
+    EXPECT(stats.untouched == untouched, "stats: wrong bytes untouched", untouched);
+    EXPECT(stats.inOthers == inOthers, "stats: wrong bytes in other blocks", inOthers);
+    EXPECT(stats.inUse == inUse, "stats: wrong bytes in use", inUse);
+    EXPECT(stats.peakInUse >= inUse, "stats: peak below bytes in use", stats.peakInUse);
+    EXPECT(stats.live == live, "stats: wrong number of allocated chunks", live);
+    unsigned long shadowed = 0;
+    for(unsigned i = 0; i < SLOTS; i++) {
+        if(shadow[i].ptr && (void *)shadow[i].ptr >= bottom && (void *)shadow[i].ptr <= top) shadowed++;
+    }
+    EXPECT(live == shadowed + extra, "allocated chunks and the shadow model disagree", live);
+
+    // __smalloc_used and __smalloc_avail read the same counters
+    unsigned short usedBlocks;
+    unsigned long usedInBlocks, availInBlocks, availInFree;
+    EXPECT(__smalloc_used(&usedBlocks, &usedInBlocks) == heap, "__smalloc_used: wrong heap size", heap);
+    EXPECT(usedBlocks == (unsigned short)blocks, "__smalloc_used: wrong block count", (unsigned long)usedBlocks);
+    EXPECT(usedInBlocks == heap - untouched, "__smalloc_used: wrong bytes used", usedInBlocks);
+    unsigned long unallocated = __smalloc_avail(&availInBlocks, &availInFree);
+    EXPECT(availInBlocks == untouched, "__smalloc_avail: wrong bytes in blocks", availInBlocks);
+    EXPECT(availInFree == inFree, "__smalloc_avail: wrong bytes in freed chunks", availInFree);
+    if(!blocks) expected = bottom;
+    EXPECT(unallocated == (unsigned long)(top - expected) + 1, "__smalloc_avail: wrong unallocated heap", unallocated);
+
+    // __smalloc_report walks the heap too, and must find the same
+    static struct SMALLOC_REPORT report;
+    __smalloc_report(&report);
+    for(unsigned long c = 0; c < SMALLOC_REPORT_CLASSES; c++) {
+        EXPECT(report.liveChunks[c] == walked.liveChunks[c], "report: wrong allocated chunks in a class", c);
+        EXPECT(report.liveBytes[c] == walked.liveBytes[c], "report: wrong allocated bytes in a class", c);
+        EXPECT(report.freeChunks[c] == walked.freeChunks[c], "report: wrong freed chunks in a class", c);
+        EXPECT(report.freeBytes[c] == walked.freeBytes[c], "report: wrong freed bytes in a class", c);
+    }
+    EXPECT(report.largestFree == walked.largestFree, "report: wrong largest freed chunk", report.largestFree);
+    EXPECT(report.largestTop == walked.largestTop, "report: wrong largest block top", report.largestTop);
+    EXPECT(report.blocks == blocks, "report: wrong block count", report.blocks);
+    for(unsigned long i = 0; i < blocks && i < SMALLOC_REPORT_BLOCKS; i++) {
+        struct SMALLOC_BLOCK_REPORT *got = &report.block[i], *want = &walked.block[i];
+        EXPECT(got->block == want->block && got->size == want->size && got->lifetime == want->lifetime,
+            "report: wrong block", got->block);
+        EXPECT(got->inUse == want->inUse, "report: wrong bytes in use in a block", got->block);
+        EXPECT(got->inFree == want->inFree, "report: wrong bytes freed in a block", got->block);
+        EXPECT(got->untouched == want->untouched, "report: wrong bytes untouched in a block", got->block);
+    }
+    // no heap here is big enough for largest * 1000 to overflow
+    unsigned long largest = walked.largestFree > walked.largestTop ? walked.largestFree : walked.largestTop;
+    unsigned fragmentation = inFree + untouched ? (unsigned)(1000 - largest * 1000 / (inFree + untouched)) : 0;
+    EXPECT(report.fragmentation == fragmentation, "report: wrong fragmentation", (unsigned long)report.fragmentation);
+
+    binned = binnedBytes = 0;
+    __smalloc_visit_bins(visit_bin);
+    EXPECT(binned == freeCount, "free chunk missing from the bins", binned);
+    EXPECT(binnedBytes == inFree, "bins and free chunks disagree", binnedBytes);
+#ifdef SMALLOC_DEBUG
+    EXPECT(!__smalloc_check(), "__smalloc_check found problems", NULL);
+#endif
+}
+
+static void check_heap(void) {
+#ifdef SMALLOC_DEFER
+    __smalloc_drain(); // pending sfrees don't show in the heap until they are binned
+#endif
+    check_one_heap(heapBottom, heapTop, extraLive);
+    if(other) {
+        __smalloc_diagnose(other);
+        check_one_heap(otherBottom, otherTop, 0);
+        __smalloc_diagnose(NULL);
+    }
+
+    for(unsigned i = 0; i < SLOTS; i++) {
+        struct SHADOW *slot = &shadow[i];
+        if(!slot->ptr) continue;
+        struct CHUNK *chunk = (void *)slot->ptr - CHUNK_HEADER_SZ;
+        EXPECT((unsigned long)slot->ptr % SMALLOC_ALIGN == 0, "allocation is not aligned", slot->ptr);
+        EXPECT(CHUNK_FLAGS(chunk) & ALLOCD, "allocation is not ALLOCD", slot->ptr);
+        EXPECT(CHUNK_SIZE(chunk) >= slot->size + CHUNK_HEADER_SZ, "allocation's chunk is too small", slot->ptr);
+        EXPECT(intact(slot, slot->size), "allocation was overwritten", slot->ptr);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// random steps
+//////////////////////////////////////////////////////////////////////////
+
+static unsigned long failedAllocations;
+
+static void step_alloc(void) {
+    struct SHADOW *slot = empty_slot();
+    if(!slot) return;
+    unsigned long size = rnd_size();
+    unsigned char *ptr;
+    unsigned how = rnd(10);
+    if(other && !rnd(4)) {
+        ptr = sheap_alloc(other, size);
+        EXPECT(!ptr || in_other(ptr), "sheap_alloc memory is not the heap's", ptr);
+    } else if(how < 6) {
+        ptr = smalloc(size);
+    } else if(how == 6) {
+        ptr = scalloc(1, size);
+        for(unsigned long i = 0; ptr && i < size; i++) {
+            if(ptr[i]) {
+                fail("scalloc memory is not zero", ptr);
+                break;
+            }
+        }
+    } else if(how == 7) {
+        unsigned long align = 1UL << rnd(9);
+        ptr = saligned_alloc(align, size);
+        EXPECT((unsigned long)ptr % align == 0, "saligned_alloc memory is not aligned", ptr);
+    } else if(how == 8) {
+        ptr = smalloc_hint(size, SMALLOC_SHORT);
+    } else {
+        struct SHADOW *near = live_slot();
+        ptr = smalloc_near(near ? near->ptr : NULL, size);
+        EXPECT(!ptr || !near || in_other(ptr) == in_other(near->ptr), "smalloc_near memory is in another heap", ptr);
+    }
+    if(!ptr) {
+        failedAllocations++;
+        return;
+    }
+    track(slot, ptr, size);
+}
+
+// whether ptr is in a block of the heap, i.e. its memory is still the heap's
+static int in_block(void *ptr) {
+    for(struct BLOCK *block = __smalloc_first_block(); block; block = block->next) {
+        if(ptr >= (void *)block && ptr < (void *)block + block->size) return 1;
+    }
+    return 0;
+}
+
+static void step_free(void) {
+    struct SHADOW *slot = live_slot();
+    if(!slot) return;
+    void *ptr = slot->ptr;
+    struct CHUNK *chunk = ptr - CHUNK_HEADER_SZ;
+    // a double free must leave the heap alone -- as long as the chunk's header
+    // survives the first sfree, i.e. it isn't merged into a free chunk in front of it
+    // and its block isn't given back (an mmap heap releases the pages)
+    int twice = !(CHUNK_FLAGS(chunk) & PREVFREE) && !rnd(16);
+    if(in_other(ptr) && rnd(2)) sheap_free(other, ptr);
+    else sfree(ptr);
+    untrack(slot);
+    if(twice && in_block(chunk)) {
+        sfree(ptr);
+        expectedFaults++;
+    }
+}
+
+static void step_realloc(void) {
+    struct SHADOW *slot = live_slot();
+    if(!slot) return;
+    unsigned long size = rnd(32) ? rnd_size() : 0;
+    unsigned char *ptr = srealloc(slot->ptr, size);
+    if(!size) {
+        EXPECT(!ptr, "srealloc to 0 returned memory", ptr);
+        untrack(slot);
+        return;
+    }
+    if(!ptr) {
+        failedAllocations++;
+        return; // the allocation is untouched, and checked as usual
+    }
+    EXPECT(in_other(ptr) == in_other(slot->ptr), "srealloc moved memory to another heap", ptr);
+    slot->ptr = ptr;
+    EXPECT(intact(slot, slot->size < size ? slot->size : size), "srealloc lost the contents", ptr);
+    shadowLive--;
+    track(slot, ptr, size);
+}
+
+static int by_address(const void *a, const void *b) {
+    void *pa = *(void * const *)a, *pb = *(void * const *)b;
+    return pa < pb ? -1 : pa > pb;
+}
 
+static void step_batch(void) {
+    void *ptrs[BATCH];
+    unsigned count = 1 + rnd(BATCH);
+    if(rnd(2)) {
+        if(SLOTS - shadowLive < count) return;
+        unsigned long size = rnd_size();
+        unsigned long done = smalloc_n(size, count, ptrs);
+        if(done < count) failedAllocations++;
+        for(unsigned long i = 0; i < done; i++) track(empty_slot(), ptrs[i], size);
+    } else {
+        unsigned n = 0;
+        for(; n < count && shadowLive; n++) {
+            struct SHADOW *slot = live_slot();
+            ptrs[n] = slot->ptr;
+            untrack(slot);
         }
-        block = block->next;
+        qsort(ptrs, n, sizeof(void *), by_address);
+        sfree_n(ptrs, n);
     }
 }
 
-int main(int argc, const char* argv[]) {
-    size_t alloc = (1<<16) * 4; // 64k*4 = 256K
-    void *b = malloc(alloc);
-    void *t = b + alloc - 1;
+// a pool or an arena takes whole blocks from the heap and hands them back
+static void step_others(void) {
+    if(rnd(2)) {
+        struct SPOOL *pool = spool_create(8 + rnd(120), 1 + rnd(64));
+        if(!pool) return;
+        extraLive++;
+        for(unsigned n = rnd(200); n; n--) spool_alloc(pool);
+        check_heap();
+        spool_destroy(pool);
+        extraLive--;
+    } else {
+        struct SARENA *arena = sarena_begin(1 + rnd(4 * pageSize));
+        if(!arena) return;
+        while(sarena_alloc(arena, 1 + rnd(256)));
+        check_heap();
+        sarena_end(arena);
+    }
+}
 
-    // use blocks of 1K -- should allow us to pack allocations
-    // and get a bunch of overhead due to many blocks
-    __smalloc_init((unsigned long)b, (unsigned long)t, 1 << 10);
-    
-    // fill the heap
-    for(int i=0; i < 512; i++) {
-        void *m = smalloc(i+13);
-        *((char *)m) = 'I';
-        *((int *)(m+1)) = i;
-        printf("Allocated %d bytes: %p\n", i, m);
-        debug_out();
+static void free_all(void) {
+    for(unsigned i = 0; i < SLOTS; i++) {
+        if(!shadow[i].ptr) continue;
+        sfree(shadow[i].ptr);
+        untrack(&shadow[i]);
     }
+}
 
-    // allocate and deallocate the same size -- should result
-    // in no incremental heap growth
-    for(int i=0; i<1000; i++) {
-        void *m = smalloc(128);
-        printf("%d: %p     ", i, m);
-        debug_out();
-        *((char *)m) = 'J';
-        *((int *)(m+1)) = i+1;
-        sfree(m);
+static void stress(const struct CONFIG *config) {
+    static char name[64];
+    snprintf(name, sizeof(name), "heap=%luK page=%lu offset=%lu%s%s%s", config->size >> 10, config->pageSize, config->offset,
+        config->flags & HEAP_ZEROED ? " zeroed" : "", config->flags & HEAP_MMAP ? " mmap" : "",
+        config->flags & HEAP_SHEAP ? " sheap" : "");
+    testing = name;
+    failedAllocations = 0;
+    unsigned long failed = failures;
+
+    init_heap(config->size, config->offset, config->pageSize, config->flags);
+    check_heap();
+
+    for(step = 1; step <= STEPS; step++) {
+        unsigned r = rnd(100);
+        if(r < 40) step_alloc();
+        else if(r < 70) step_free();
+        else if(r < 90) step_realloc();
+        else if(r < 98) step_batch();
+        else step_others();
+        check_heap();
     }
 
-    // allocate something too big
-    void *toobig = smalloc(alloc+1);
-    // should be 0x0
-    printf("toobig = %p\n", toobig);
+    struct SMALLOC_STATS stats;
+    __smalloc_stats(&stats);
+    unsigned long peak = stats.peakInUse;
+    free_all();
+    check_heap();
+    __smalloc_stats(&stats);
+    EXPECT(!stats.live && !stats.inUse, "memory still in use after freeing everything", stats.inUse);
+#ifndef SMALLOC_RT
+    EXPECT(!stats.blocks, "empty blocks left after freeing everything", stats.blocks);
+#endif
+    if(other) {
+        __smalloc_diagnose(other);
+        __smalloc_stats(&stats);
+        __smalloc_diagnose(NULL);
+        EXPECT(stats.allocations && !stats.live && !stats.inUse, "second heap unused, or still in use", stats.inUse);
+    }
+    put_away_heap();
+
+    printf("%s: %lu steps, %lu allocations failed, peak %lu bytes in use: %s\n",
+        name, STEPS, failedAllocations, peak, failures == failed ? "ok" : "FAILED");
+    free(memory);
+}
 
+//////////////////////////////////////////////////////////////////////////
+// the memory and string routines
+//////////////////////////////////////////////////////////////////////////
+
+#define MEM_MAX     (3 * MEM_UNROLL_SZ + MEM_WORD_SZ)   // the longest run checked: a head, words and a tail
+#define MEM_BUF     (4 * MEM_MAX)
+
+// called through pointers, so the compiler can't put its builtins in their place
+static void *(*volatile copy)(void *, const void *, unsigned long) = memcpy;
+static void *(*volatile move)(void *, const void *, unsigned long) = memmove;
+static void *(*volatile fill)(void *, int, unsigned long) = memset;
+static int (*volatile compare)(const void *, const void *, unsigned long) = memcmp;
+static unsigned long (*volatile measure)(const char *) = strlen;
+
+// bytes of every value, high bits and all, that differ with salt
+static void pattern(unsigned char *bytes, unsigned long len, unsigned salt) {
+    for(unsigned long i = 0; i < len; i++) bytes[i] = (unsigned char)(i * 167 + salt);
+}
+
+// where two buffers first differ (a byte at a time), or MEM_BUF if they don't
+static unsigned long differs(const unsigned char *x, const unsigned char *y) {
+    unsigned long i = 0;
+    while(i < MEM_BUF && x[i] == y[i]) i++;
+    return i;
+}
+
+static int sign(int v) {
+    return (v > 0) - (v < 0);
+}
+
+// memcpy, memmove, memset and memcmp do what a byte at a time would, for every
+// alignment of their pointers and every length up to a few unrolled loops
+static void mem_routines(void) {
+    testing = "mem routines";
+    unsigned long failed = failures;
+    static unsigned char buf[MEM_BUF], want[MEM_BUF], from[MEM_BUF];
+    for(unsigned long n = 0; n <= MEM_MAX; n++) {
+        step = n;
+        for(unsigned long d = 0; d < MEM_WORD_SZ; d++) {
+            // memset only uses the low byte of c
+            int c = (int)(0x100 | ((n * 29 + d * 7) & 0xff));
+            pattern(buf, MEM_BUF, 1);
+            pattern(want, MEM_BUF, 1);
+            for(unsigned long i = 0; i < n; i++) want[d + i] = (unsigned char)c;
+            EXPECT(fill(buf + d, c, n) == buf + d, "memset: wrong result", d);
+            EXPECT(differs(buf, want) == MEM_BUF, "memset: wrong bytes", d);
+
+            for(unsigned long s = 0; s < MEM_WORD_SZ; s++) {
+                pattern(from, MEM_BUF, 2);
+                pattern(buf, MEM_BUF, 3);
+                pattern(want, MEM_BUF, 3);
+                for(unsigned long i = 0; i < n; i++) want[d + i] = from[s + i];
+                EXPECT(copy(buf + d, from + s, n) == buf + d, "memcpy: wrong result", s);
+                EXPECT(differs(buf, want) == MEM_BUF, "memcpy: wrong bytes", s);
+
+                // equal, then one byte different, either way round: bytes compare as
+                // unsigned, and a difference past the end doesn't count
+                for(unsigned long i = 0; i <= n; i++) from[s + i] = buf[d + i];
+                EXPECT(!compare(buf + d, from + s, n), "memcmp: equal bytes differ", s);
+                for(unsigned long k = 0; k <= n; k++) {
+                    unsigned char a = buf[d + k], b = from[s + k];
+                    buf[d + k] = 0x80;
+                    from[s + k] = 0x7f;
+                    int expected = k < n;
+                    EXPECT(sign(compare(buf + d, from + s, n)) == expected, "memcmp: wrong sign", k);
+                    EXPECT(sign(compare(from + s, buf + d, n)) == -expected, "memcmp: wrong sign", k);
+                    buf[d + k] = a;
+                    from[s + k] = b;
+                }
+            }
+        }
+
+        // memmove within one buffer, overlapping by every distance either way, and just not
+        for(unsigned long s = MEM_MAX + MEM_WORD_SZ; s < MEM_MAX + 2 * MEM_WORD_SZ; s++) {
+            for(unsigned long d = s - n - 1; d <= s + n + 1; d++) {
+                pattern(buf, MEM_BUF, 4);
+                pattern(want, MEM_BUF, 4);
+                pattern(from, MEM_BUF, 4);
+                for(unsigned long i = 0; i < n; i++) want[d + i] = from[s + i];
+                EXPECT(move(buf + d, buf + s, n) == buf + d, "memmove: wrong result", d);
+                EXPECT(differs(buf, want) == MEM_BUF, "memmove: wrong bytes", d);
+            }
+        }
+    }
+    printf("%s: lengths up to %lu: %s\n", testing, (unsigned long)MEM_MAX, failures == failed ? "ok" : "FAILED");
+}
+
+// strlen finds the terminator at every offset from every start alignment -- in
+// the head, in any byte of a word -- among bytes with their high bits set (which
+// a word test that only looked for a clear high bit would take for zero), and
+// doesn't see past it
+static void strlen_offsets(void) {
+    testing = "strlen";
+    unsigned long failed = failures;
+    static unsigned char buf[MEM_BUF];
+    for(unsigned salt = 0; salt < 4; salt++) {
+        pattern(buf, MEM_BUF, salt * 61);
+        for(unsigned long i = 0; i < MEM_BUF; i++) {
+            if(!buf[i]) buf[i] = 0x80;
+            if(salt & 1) buf[i] |= 0x80; // only high-bit bytes
+        }
+        for(unsigned long a = 0; a < MEM_WORD_SZ; a++) {
+            for(unsigned long n = 0; n <= MEM_MAX; n++) {
+                step = n;
+                unsigned char *str = buf + MEM_WORD_SZ + a;
+                unsigned char after = str[n], later = str[n + MEM_WORD_SZ];
+                str[n] = 0;
+                str[n + MEM_WORD_SZ] = 0; // a second terminator, a word on
+                EXPECT(measure((const char *)str) == n, "strlen: wrong length", measure((const char *)str));
+                str[n] = after;
+                str[n + MEM_WORD_SZ] = later;
+            }
+        }
+    }
+    printf("%s: lengths up to %lu: %s\n", testing, (unsigned long)MEM_MAX, failures == failed ? "ok" : "FAILED");
+}
+
+//////////////////////////////////////////////////////////////////////////
+// regressions
+//////////////////////////////////////////////////////////////////////////
+
+static void regressions(void) {
+    testing = "regressions";
+    step = 0;
+    unsigned long size = 256 << 10;
+    init_heap(size, 0, 1 << 10, 0);
+
+    // blocks follow each other with no gap, e.g. no + 1 between them
+    for(unsigned i = 0; i < 64; i++) track(&shadow[i], smalloc(i * 40 + 13), i * 40 + 13);
+    check_heap();
+
+    // something too big fails and leaves the heap as it was
+    EXPECT(!smalloc(size + 1), "smalloc of more than the heap returned memory", NULL);
+    EXPECT(!smalloc(~0UL), "smalloc of ~0 returned memory", NULL);
+    EXPECT(!scalloc(~0UL / 2, 3), "scalloc that overflows returned memory", NULL);
+    check_heap();
+
+    // a double free doesn't mess up the internals: the chunk is handed out once, not twice
     void *smaller = smalloc(1025);
-    printf("smaller = %p\n", smaller);
     sfree(smaller);
-    sfree(smaller); // gasp double-free -- should not mess up the internals
-    smaller = smalloc(1025); // this should be the original smaller pointer
-    printf("smaller = %p\n", smaller);
-    smaller = smalloc(1025); // leaked memory, BUT this should be different address
-    printf("smaller = %p\n", smaller);
+    sfree(smaller);
+    expectedFaults++;
+    check_heap();
+    void *again = smalloc(1025);
+    EXPECT(again == smaller, "memory freed twice is not reused", again);
+    void *other = smalloc(1025);
+    EXPECT(other && other != again, "memory freed twice is handed out twice", other);
+    track(&shadow[64], again, 1025);
+    track(&shadow[65], other, 1025);
+    check_heap();
+
+    // sfree(NULL) and srealloc(NULL, n) are fine
+    sfree(NULL);
+    void *fresh = srealloc(NULL, 100);
+    EXPECT(fresh, "srealloc(NULL, n) returned no memory", NULL);
+    track(&shadow[66], fresh, 100);
+    check_heap();
+
+    free_all();
+    check_heap();
+
+    // a batch of nothing allocates nothing, and makes no block for it (there are none to use)
+    struct SMALLOC_STATS before, after;
+    __smalloc_stats(&before);
+    void *none[1] = { NULL };
+    EXPECT(!smalloc_n(16, 0, none) && !none[0], "smalloc_n of no objects allocated some", none[0]);
+    EXPECT(!smalloc_n(8 << 10, 0, none) && !none[0], "smalloc_n of no objects allocated some", none[0]);
+    __smalloc_stats(&after);
+    EXPECT(after.blocks == before.blocks && after.allocations == before.allocations, "smalloc_n of no objects changed the heap", after.blocks);
+    check_heap();
+
+    // a heap that can't hold a block leaves no memory behind, not the old heap
+    EXPECT(!__smalloc_init((unsigned long)memory, (unsigned long)memory + 100, 1 << 10), "__smalloc_init of too little memory worked", NULL);
+    EXPECT(!smalloc(16), "smalloc from a heap with no memory returned memory", NULL);
+    __smalloc_set_zeroed();
+    EXPECT(!__smalloc_first_block(), "a failed __smalloc_init left blocks", __smalloc_first_block());
+#ifdef SMALLOC_MMAP
+    EXPECT(__smalloc_init_mmap(1 << 20, 8 << 10), "__smalloc_init_mmap failed", NULL);
+    EXPECT(smalloc(100), "smalloc from an mmap heap returned no memory", NULL);
+    EXPECT(!__smalloc_init_mmap(4 << 10, 8 << 10), "__smalloc_init_mmap of less than a page worked", NULL);
+    __smalloc_set_zeroed(); // mustn't look at the old, unmapped heap
+    EXPECT(!__smalloc_first_block(), "a failed __smalloc_init_mmap left the old heap", __smalloc_first_block());
+    EXPECT(!smalloc(16), "smalloc from a heap with no memory returned memory", NULL);
+#endif
+    printf("%s: %s\n", testing, failures ? "FAILED" : "ok");
+    free(memory);
+}
+
+// The smallest free chunk of at least need bytes, found by walking the whole
+// heap; freeChunks is left holding every free chunk of that size
+static unsigned long smallest_free(unsigned long need) {
+    unsigned long best = 0;
+    for(int pass = 0; pass < 2; pass++) {
+        freeCount = 0;
+        for(struct BLOCK *block = __smalloc_first_block(); block; block = block->next) {
+            if(block->kind != BLOCK_CHUNKS) continue;
+            for(struct CHUNK *chunk = (void *)block + BLOCK_HEADER_SZ; (void *)chunk < block->top;
+                chunk = (void *)chunk + CHUNK_SIZE(chunk)) {
+                unsigned long size = CHUNK_SIZE(chunk);
+                if((CHUNK_FLAGS(chunk) & ALLOCD) || size < need) continue;
+                if(!pass && (!best || size < best)) best = size;
+                if(pass && size == best) note_free(chunk);
+            }
+        }
+    }
+    return best;
+}
+
+// large requests are served from the smallest free chunk that fits: the tree
+// bins' best fit is checked against a brute-force search of the heap
+static void best_fit(void) {
+    testing = "best fit";
+    unsigned long failed = failures;
+    unsigned long size = 1 << 20;
+    init_heap(size, 0, 8 << 10, 0);
+
+    unsigned long checked = 0;
+    for(step = 1; step <= STEPS; step++) {
+        struct SHADOW *slot = rnd(2) ? live_slot() : NULL;
+        if(slot) {
+            sfree(slot->ptr);
+            untrack(slot);
+        } else if((slot = empty_slot())) {
+            // big enough for the tree bins, and some small ones in between
+            unsigned long n = rnd(4) ? 512 + rnd(6000) : 1 + rnd(200);
+#ifdef SMALLOC_DEFER
+            __smalloc_drain();
+#endif
+            unsigned long best = n >= 512 ? smallest_free(__chunk_size(n)) : 0;
+            unsigned char *ptr = smalloc(n);
+            if(!ptr) continue;
+            if(best) {
+                EXPECT(find_free((void *)ptr - CHUNK_HEADER_SZ) < freeCount, "large request not served by the best fit", ptr);
+                checked++;
+            }
+            track(slot, ptr, n);
+        }
+        check_heap();
+    }
+    free_all();
+    check_heap();
+    printf("%s: %lu requests checked: %s\n", testing, checked, failures == failed ? "ok" : "FAILED");
+    free(memory);
+}
+
+#ifdef SMALLOC_SAFE
+// a small free followed by an allocation of the same size is served from the
+// context's cache, whether or not the request is smaller than a minimum chunk
+static void cache_hits(void) {
+    testing = "cache hits";
+    step = 0;
+    unsigned long failed = failures;
+    unsigned long size = 64 << 10;
+    init_heap(size, 0, 1 << 10, 0);
+
+    struct SMALLOC_STATS before, after;
+    __smalloc_stats(&before);
+    static struct SCACHE cache;
+    struct SCACHE *previous = __smalloc_enter(&cache);
+    unsigned long n = 0;
+    for(; n <= (SMALLOC_CACHE_CLASSES - 1) * SMALLOC_ALIGN; n++) {
+        void *ptr = smalloc(n);
+        sfree(ptr);
+        void *again = smalloc(n);
+        EXPECT(again == ptr, "smalloc missed the cache", n);
+        sfree(again);
+        again = __smalloc_obj(n);
+        EXPECT(again == ptr, "__smalloc_obj missed the cache", n);
+        sfree(again);
+        EXPECT(cache.count[SMALLOC_CLASS(n)] == 1, "cache holds the wrong chunks", n);
+    }
+    // cache hits count as allocations, before and after the cache is flushed
+    __smalloc_stats(&after);
+    EXPECT(after.allocations - before.allocations == 3 * n, "stats: cache hits not counted", after.allocations);
+    __smalloc_flush(&cache);
+    __smalloc_stats(&after);
+    EXPECT(after.allocations - before.allocations == 3 * n, "stats: flushed cache hits not counted", after.allocations);
 
-    // now dump the heap structures
-    print_heap();
+    // SMALLOC_OBJ pops from the entered cache inline: a hit when the cache has a chunk
+    // of that class, and smalloc on a miss -- an empty class, a T too big to cache, no cache
+    struct OBJ { unsigned long words[3]; };
+    struct BIG { char bytes[SMALLOC_CACHE_CLASSES * SMALLOC_ALIGN]; };
+    struct OBJ *obj = SMALLOC_OBJ(struct OBJ);
+    unsigned long served = cache.allocations;
+    struct OBJ *miss = SMALLOC_OBJ(struct OBJ);
+    EXPECT(miss && cache.allocations == served, "SMALLOC_OBJ hit an empty class", miss);
+    sfree(obj);
+    struct OBJ *hit = SMALLOC_OBJ(struct OBJ);
+    EXPECT(hit == obj && cache.allocations == served + 1, "SMALLOC_OBJ missed the cache", hit);
+    EXPECT(!cache.count[SMALLOC_CLASS(sizeof(struct OBJ))], "SMALLOC_OBJ left its chunk cached", hit);
+    struct BIG *big = SMALLOC_OBJ(struct BIG);
+    sfree(big);
+    struct BIG *bigAgain = SMALLOC_OBJ(struct BIG);
+    EXPECT(bigAgain && cache.allocations == served + 1, "SMALLOC_OBJ cached a chunk too big for it", bigAgain);
+    sfree(hit);
+    __smalloc_enter(NULL);
+    struct OBJ *uncached = SMALLOC_OBJ(struct OBJ);
+    EXPECT(uncached && uncached != hit && cache.allocations == served + 1, "SMALLOC_OBJ used a cache it wasn't in", uncached);
+    EXPECT(cache.count[SMALLOC_CLASS(sizeof(struct OBJ))] == 1, "SMALLOC_OBJ took from a cache it wasn't in", uncached);
+    sfree(uncached);
+    sfree(bigAgain);
+    sfree(miss);
+    __smalloc_flush(&cache);
+    __smalloc_enter(previous);
+    check_heap();
 
+    printf("%s: %s\n", testing, failures == failed ? "ok" : "FAILED");
+    free(memory);
+}
+#endif
+
+// compaction moves unlocked handles, and only them: locked handles and plain
+// chunks, even one that looks like a handle's, stay where they are
+static void compaction(void) {
+    testing = "compaction";
+    step = 0;
+    unsigned long failed = failures;
+    init_heap(128 << 10, 0, 1 << 10, 0);
+
+    // room low in the heap, for a handle in the last block to be moved to
+    void *room = smalloc(4 << 10);
+    extraLive++;
+
+    // a plain chunk after a gap, pointing at plain memory that points right back
+    // at it, the way a handle's chunk and its master do
+    void *gap = smalloc(64);
+    void **decoy = smalloc(64), **master = smalloc(64);
+    memset(decoy, 0x5a, 64);
+    memset(master, 0, 64);
+    decoy[0] = master;
+    master[0] = (void *)decoy + ALIGN_UP(sizeof(void *), SMALLOC_ALIGN);
+    extraLive += 3;
+
+    // handles, every fifth one locked, with plain chunks between them
+    void **handles[HANDLES];
+    unsigned long sizes[HANDLES];
+    void *pinned[HANDLES];
+    for(unsigned i = 0; i < HANDLES; i++) {
+        sizes[i] = 1 + rnd(300);
+        handles[i] = shandle_alloc(sizes[i]);
+        pinned[i] = NULL;
+        if(!handles[i]) {
+            fail("shandle_alloc returned no memory", NULL);
+            continue;
+        }
+        if(!i) extraLive++; // the masters' spool
+        extraLive++;
+        memset(*handles[i], i, sizes[i]);
+        if(i % 5 == 0) pinned[i] = shandle_lock(handles[i]);
+        unsigned long n = rnd_size();
+        void *ptr = i % 3 ? NULL : smalloc(n);
+        if(ptr) track(empty_slot(), ptr, n);
+    }
+    check_heap();
+
+    // gaps in front of the handles, for compaction to close
+    sfree(gap);
+    extraLive--;
+    for(unsigned i = 0; i < HANDLES; i++) {
+        if(!handles[i] || pinned[i] || rnd(2)) continue;
+        shandle_free(handles[i]);
+        handles[i] = NULL;
+        extraLive--;
+    }
+    for(unsigned i = 0; i < SLOTS; i++) {
+        if(!shadow[i].ptr || rnd(2)) continue;
+        sfree(shadow[i].ptr);
+        untrack(&shadow[i]);
+    }
+    check_heap();
+
+    unsigned long moved = 1, total = 0;
+    for(step = 1; step <= 1000 && moved; step++) {
+        moved = __smalloc_compact(256);
+        total += moved;
+        check_heap();
+    }
+    EXPECT(!moved, "compaction doesn't finish", total);
+    EXPECT(total, "compaction moved nothing", NULL);
+
+    for(unsigned i = 0; i < HANDLES; i++) {
+        if(!handles[i]) continue;
+        unsigned char *ptr = *handles[i];
+        EXPECT(!pinned[i] || ptr == pinned[i], "a locked handle moved", ptr);
+        for(unsigned long j = 0; j < sizes[i]; j++) {
+            if(ptr[j] != (unsigned char)i) {
+                fail("handle memory changed", ptr + j);
+                break;
+            }
+        }
+        if(pinned[i]) shandle_unlock(handles[i]);
+    }
+    struct CHUNK *chunk = (void *)decoy - CHUNK_HEADER_SZ;
+    EXPECT(CHUNK_FLAGS(chunk) & ALLOCD, "plain chunk moved by compaction", decoy);
+    EXPECT(decoy[0] == master && master[0] == (void *)decoy + ALIGN_UP(sizeof(void *), SMALLOC_ALIGN) && !master[1],
+        "plain chunks changed by compaction", decoy);
+    for(unsigned j = sizeof(void *); j < 64; j++) EXPECT(((unsigned char *)decoy)[j] == 0x5a, "plain chunk changed by compaction", decoy);
+
+    // a handle too big for any free chunk gets a last block of its own, which
+    // compaction empties into the room below and gives back
+    void **last = shandle_alloc(3000);
+    EXPECT(last, "shandle_alloc returned no memory", NULL);
+    unsigned char *was = *last;
+    memset(was, 0xa5, 3000);
+    extraLive++;
+    struct BLOCK *block = __smalloc_first_block();
+    while(block->next) block = block->next;
+    EXPECT((void *)was > (void *)block && (void *)was < (void *)block + block->size, "big handle is not in the last block", was);
+    sfree(room);
+    extraLive--;
+    struct SMALLOC_STATS before, after;
+    __smalloc_stats(&before);
+    for(moved = 1, step = 1; step <= 1000 && moved; step++) {
+        moved = __smalloc_compact(4 << 10);
+        total += moved;
+        check_heap();
+    }
+    __smalloc_stats(&after);
+    unsigned char *now = *last;
+    EXPECT(now < was, "the last block's handle was not moved down", now);
+    EXPECT(after.blocks < before.blocks, "the emptied last block was not given back", after.blocks);
+    for(unsigned j = 0; j < 3000; j++) {
+        if(now[j] != 0xa5) {
+            fail("handle memory changed", now + j);
+            break;
+        }
+    }
+    shandle_free(last);
+    extraLive--;
+
+    // the masters' spool goes with the last handle
+    for(unsigned i = 0; i < HANDLES; i++) {
+        if(!handles[i]) continue;
+        shandle_free(handles[i]);
+        extraLive--;
+    }
+    extraLive--;
+    sfree(decoy);
+    sfree(master);
+    extraLive -= 2;
+    free_all();
+    check_heap();
+
+    printf("%s: %lu bytes moved: %s\n", testing, total, failures == failed ? "ok" : "FAILED");
+    free(memory);
+}
+
+#ifdef SMALLOC_TRACE
+static FILE *traceFile;             // where every record is dumped, for smalloc_bench -b
+static unsigned long sunk;          // records handed to the sink
+static unsigned long ticks;
+
+static void sink_record(const struct STRACE *record) {
+    sunk++;
+    if(traceFile) fwrite(record, sizeof(*record), 1, traceFile);
+}
+
+static unsigned long tick(void) {
+    return ticks++;
+}
+
+static unsigned long get_le(const unsigned char *bytes, unsigned count) {
+    unsigned long value = 0;
+    while(count--) value = value << 8 | bytes[count];
+    return value;
+}
+
+// a record holds what was done, when, and the pointers in full
+static void expect_record(const struct STRACE *record, unsigned char op, void *ptr, unsigned long size, void *old, unsigned long when) {
+    EXPECT(record->op == op, "trace: wrong op", (unsigned long)record->op);
+    EXPECT(get_le(record->size, sizeof(record->size)) == size, "trace: wrong size", get_le(record->size, sizeof(record->size)));
+    EXPECT(get_le(record->tick, sizeof(record->tick)) == when, "trace: wrong tick", get_le(record->tick, sizeof(record->tick)));
+    EXPECT(get_le(record->ptr, sizeof(record->ptr)) == (unsigned long)ptr, "trace: wrong pointer", get_le(record->ptr, sizeof(record->ptr)));
+    EXPECT(get_le(record->old, sizeof(record->old)) == (unsigned long)old, "trace: wrong old pointer", get_le(record->old, sizeof(record->old)));
+}
+
+// every smalloc, srealloc and sfree is recorded, in order, and records are
+// only lost when more are made than the ring holds before they are read
+static void tracing(void) {
+    testing = "trace";
+    step = 0;
+    unsigned long failed = failures;
+    init_heap(64 << 10, 0, 1 << 10, 0);
+
+    static struct STRACE records[SMALLOC_TRACE_RING + 8];
+    unsigned long lost, n;
+    while(__smalloc_trace_read(records, SMALLOC_TRACE_RING, &lost)); // the other tests' records
+    __smalloc_set_trace(tick, sink_record);
+    ticks = 1000;
+    sunk = 0;
+    void *a = smalloc(10);
+    void *b = smalloc(300);
+    void *c = srealloc(a, 2000);
+    void *huge = smalloc(0x1000000); // fails, and its size is only kept up to 0xffffff
+    EXPECT(!huge, "smalloc of more than the heap worked", huge);
+    sfree(b);
+    sfree(c);
+    EXPECT(sunk == 6, "trace: the sink missed records", sunk);
+
+    // read in two goes
+    n = __smalloc_trace_read(records, 2, &lost);
+    EXPECT(n == 2 && !lost, "trace: wrong first read", n);
+    n += __smalloc_trace_read(records + 2, SMALLOC_TRACE_RING, &lost);
+    EXPECT(n == 6 && !lost, "trace: wrong second read", n);
+    expect_record(&records[0], 'a', a, 10, NULL, 1000);
+    expect_record(&records[1], 'a', b, 300, NULL, 1001);
+    expect_record(&records[2], 'r', c, 2000, a, 1002);
+    expect_record(&records[3], 'a', NULL, 0xffffff, NULL, 1003);
+    expect_record(&records[4], 'f', b, 0, NULL, 1004);
+    expect_record(&records[5], 'f', c, 0, NULL, 1005);
+
+    // 8 more records than the ring holds: the oldest 8 are lost, the rest are kept
+    step = 1;
+    unsigned long from = ticks;
+    void *ptrs[SMALLOC_TRACE_RING / 2 + 4];
+    for(unsigned i = 0; i < SMALLOC_TRACE_RING / 2 + 4; i++) {
+        ptrs[i] = smalloc(8 + i);
+        sfree(ptrs[i]);
+    }
+    n = __smalloc_trace_read(records, SMALLOC_TRACE_RING + 8, &lost);
+    EXPECT(n == SMALLOC_TRACE_RING, "trace: wrong records kept", n);
+    EXPECT(lost == 8, "trace: wrong records lost", lost);
+    for(unsigned long i = 0; i < n; i++) {
+        unsigned long made = i + 8; // the record's place in what was done
+        void *ptr = ptrs[made / 2];
+        if(made % 2) expect_record(&records[i], 'f', ptr, 0, NULL, from + made);
+        else expect_record(&records[i], 'a', ptr, 8 + made / 2, NULL, from + made);
+    }
+    n = __smalloc_trace_read(records, SMALLOC_TRACE_RING, &lost);
+    EXPECT(!n && !lost, "trace: records left after reading them all", lost);
+
+    __smalloc_set_trace(NULL, sink_record);
+    check_heap();
+    printf("%s: %lu records checked: %s\n", testing, 6UL + SMALLOC_TRACE_RING, failures == failed ? "ok" : "FAILED");
+    free(memory);
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifdef SMALLOC_TRACE
+    // every record is dumped to the file named, e.g. for smalloc_bench -b to replay
+    if(argc > 1 && !(traceFile = fopen(argv[1], "wb"))) perror(argv[1]);
+    __smalloc_set_trace(NULL, sink_record);
+#else
+    (void)argc;
+    (void)argv;
+#endif
+#ifdef SMALLOC_DEBUG
+    __smalloc_set_fault(count_fault);
+#endif
+    mem_routines();
+    strlen_offsets();
+    regressions();
+    best_fit();
+#ifdef SMALLOC_SAFE
+    cache_hits();
+#endif
+    compaction();
+#ifdef SMALLOC_TRACE
+    tracing();
+#endif
+    for(unsigned i = 0; i < CONFIGS; i++) stress(&configs[i]);
+#ifdef SMALLOC_DEBUG
+    testing = "faults";
+    EXPECT(faults == expectedFaults, "faults reported and double frees disagree", faults);
+#endif
+#ifdef SMALLOC_TRACE
+    if(traceFile) fclose(traceFile);
+#endif
+
+    if(failures) {
+        printf("smalloc_test: %lu checks FAILED\n", failures);
+        return 1;
+    }
+    printf("smalloc_test: all checks passed\n");
     return 0;
-}
\ No newline at end of file
+}